@@ -1,4 +1,7 @@
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
 
 #include "agent.hpp"
@@ -6,6 +9,84 @@
 #include "search.hpp"
 #include "util.hpp"
 
+namespace {
+
+// Adds the time spent in a scope to a total, unless the total is NULL
+class ScopeTimer {
+public:
+	ScopeTimer(double *total) : m_total(total) {
+		if (m_total)
+			m_start = std::chrono::steady_clock::now();
+	}
+
+	~ScopeTimer(void) {
+		if (m_total) {
+			std::chrono::duration<double> elapsed =
+				std::chrono::steady_clock::now() - m_start;
+			*m_total += elapsed.count();
+		}
+	}
+
+private:
+	double *m_total;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// Base a context tree on another one in the same state. A frozen tree is
+// copied the first time, since the search updates it in place, and from then
+// on only follows the history of the other one, which is all that changes.
+// Any other tree is replaced by an overlay over the other one.
+void followContextTree(ContextTree *&ct, FrozenContextTree *&frozen,
+                       ContextTree const& other,
+                       FrozenContextTree const *other_frozen) {
+	if (other_frozen == NULL) {
+		delete ct;
+		ct = new OverlayContextTree(other);
+		return;
+	}
+
+	if (frozen == NULL) {
+		delete ct;
+		frozen = new FrozenContextTree(*other_frozen);
+		ct = frozen;
+		return;
+	}
+
+	symbol_list_t const& history = other.history();
+	assert(ct->historySize() <= history.size());
+	for (size_t i = ct->historySize(); i < history.size(); i++)
+		ct->updateHistory(history[i]);
+}
+
+// A context tree with the backend selected by the ct-backend option, whose top
+// levels are stored in an array if at least one level below the root fits in
+// the memory given by the ct-dense-memory option, or over symbols of the
+// fields of an interaction cycle if the ct-symbol-bits option is set, or
+// factored over the bits of a cycle if factored_threads (the threads of
+// FactoredContextTree::updateInParallel()) is set
+ContextTree *newContextTree(const int depth, const bool ratio_backend,
+                            const size_t dense_memory, const int symbol_bits,
+                            const int factored_threads,
+                            std::vector<int> const& fields) {
+	if (symbol_bits > 0)
+		return new SymbolContextTree(depth, symbol_bits, fields);
+	if (factored_threads > 0) {
+		int cycle_bits = 0;
+		for (size_t i = 0; i < fields.size(); i++)
+			cycle_bits += fields[i];
+		return new FactoredContextTree(depth, cycle_bits, factored_threads);
+	}
+	if (ratio_backend)
+		return new RatioContextTree(depth);
+	const int dense_depth = DenseContextTree::denseDepth(depth, dense_memory);
+	if (dense_depth > 0)
+		return new DenseContextTree(depth, dense_depth);
+	return new ContextTree(depth);
+}
+
+}
+
+
 // construct a learning agent from the command line arguments
 Agent::Agent(options_t &options, Environment const& env) :
 	m_options(options), m_env(env)
@@ -16,18 +97,352 @@ Agent::Agent(options_t &options, Environment const& env) :
 	getRequiredOption(options, "mc-simulations", m_mc_simulations);
 	getOption(options, "learning-period", 0, m_learning_period);
 
-	// Create context tree
+	// Optional wall-clock search budget (Default: use mc-simulations)
+	getOption(options, "search-time-ms", 0, m_search_time_ms);
+	getOption(options, "search-min-simulations", 0, m_search_min_simulations);
+	getOption(options, "search-max-simulations", 0, m_search_max_simulations);
+	assert(0 <= m_search_time_ms);
+	assert(0 <= m_search_min_simulations);
+	assert(0 <= m_search_max_simulations);
+
+	// Optional early termination of the search (Default: never stop early)
+	getOption(options, "search-stop-interval", 0, m_search_stop_interval);
+	getOption(options, "search-stop-delta", 0.0, m_search_stop_delta);
+	assert(0 <= m_search_stop_interval);
+	assert(0.0 <= m_search_stop_delta && m_search_stop_delta < 1.0);
+
+	// Determine how far to revert the model after each simulation (Default:
+	// revert to the root of the search tree). Restoring versions of the model
+	// stored in the search tree works like reverting to the shared ancestor,
+	// except that no update is ever reverted.
+	std::string search_revert;
+	getOption(options, "search-revert", std::string("root"), search_revert);
+	m_revert_to_snapshot = false;
+	m_root_version = NULL;
+	if (search_revert == "root") {
+		m_revert_to_ancestor = false;
+	} else if (search_revert == "ancestor") {
+		m_revert_to_ancestor = true;
+	} else if (search_revert == "snapshot") {
+		m_revert_to_ancestor = true;
+		m_revert_to_snapshot = true;
+	} else {
+		std::cerr << "ERROR: Unknown search-revert value: '" << search_revert
+			<< "'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	m_model_shared = 0;
+
+	// Determine whether to store the percept distributions at chance nodes
+	// (Default: no, unless needed when reverting to the shared ancestor)
+	std::string percept_cache;
+	getOption(options, "search-percept-cache", std::string("none"),
+	          percept_cache);
+	if (percept_cache == "none") {
+		m_percept_cache = no_percept_cache;
+	} else if (percept_cache == "lazy") {
+		m_percept_cache = lazy_percept_cache;
+	} else if (percept_cache == "alias") {
+		m_percept_cache = alias_percept_cache;
+	} else {
+		std::cerr << "ERROR: Unknown search-percept-cache value: '"
+			<< percept_cache << "'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (m_revert_to_ancestor && m_percept_cache == no_percept_cache)
+		m_percept_cache = lazy_percept_cache;
+	getOption(options, "search-percept-enumerate-bits", 12,
+	          m_percept_enumerate_bits);
+
+	// Optional limit on the size of the search tree (Default: no limit)
+	getOption(options, "search-max-nodes", 0, m_search_max_nodes);
+	assert(0 <= m_search_max_nodes);
+
+	// Optionally truncate playouts, estimating the reward of the remaining
+	// cycles (Default: play out to the horizon)
+	getOption(options, "playout-depth", 0, m_playout_depth);
+	assert(0 <= m_playout_depth);
+	std::string playout_value;
+	getOption(options, "playout-value", std::string("average"), playout_value);
+	if (playout_value == "average") {
+		m_playout_value = average_playout_value;
+	} else if (playout_value == "percept") {
+		m_playout_value = percept_playout_value;
+	} else {
+		std::cerr << "ERROR: Unknown playout-value value: '" << playout_value
+			<< "'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// Detailed metrics of each search are only collected on request (see
+	// Agent::collectMetrics())
+	m_collect_metrics = false;
+	m_metrics = NULL;
+
+	// Optionally keep the search tree between cycles, and search in the
+	// background while the environment computes the next percept (Default:
+	// start each search from scratch)
+	std::string search_reuse;
+	getOption(options, "search-reuse", std::string("none"), search_reuse);
+	if (search_reuse == "none") {
+		m_search_reuse = no_search_reuse;
+	} else if (search_reuse == "tree") {
+		m_search_reuse = tree_search_reuse;
+	} else if (search_reuse == "ponder") {
+		m_search_reuse = ponder_search_reuse;
+	} else {
+		std::cerr << "ERROR: Unknown search-reuse value: '" << search_reuse
+			<< "'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (m_search_reuse == ponder_search_reuse && m_revert_to_ancestor) {
+		std::cerr << "ERROR: search-reuse value 'ponder' requires "
+			<< "search-revert value 'root'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	m_search_tree = NULL;
+	m_ponder_stop = false;
+
+	// Optional progressive widening of chance nodes (Default: no widening)
+	getOption(options, "search-widening-k", 0.0, m_widening_k);
+	getOption(options, "search-widening-alpha", 0.5, m_widening_alpha);
+	assert(0.0 <= m_widening_k);
+	assert(0.0 <= m_widening_alpha && m_widening_alpha <= 1.0);
+
+	// Optional progressive widening of decision nodes (Default: consider all
+	// actions)
+	getOption(options, "search-action-widening-k", 0.0,
+	          m_action_widening_k);
+	getOption(options, "search-action-widening-alpha", 0.5,
+	          m_action_widening_alpha);
+	assert(0.0 <= m_action_widening_k);
+	assert(0.0 <= m_action_widening_alpha && m_action_widening_alpha <= 1.0);
+
+	// Determine whether chance nodes branch on the sampled percepts (Default:
+	// closed loop, i.e. they do). In an open loop, the search tree is indexed
+	// by actions only, so percept caches and transpositions (which rely on
+	// the model being in the same state at each visit) and progressive
+	// widening do not apply.
+	std::string search_loop;
+	getOption(options, "search-loop", std::string("closed"), search_loop);
+	if (search_loop == "closed") {
+		m_open_loop = false;
+	} else if (search_loop == "open") {
+		m_open_loop = true;
+	} else {
+		std::cerr << "ERROR: Unknown search-loop value: '" << search_loop
+			<< "'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (m_open_loop && m_revert_to_ancestor) {
+		std::cerr << "ERROR: search-loop value 'open' requires "
+			<< "search-revert value 'root'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (m_open_loop) {
+		m_percept_cache = no_percept_cache;
+		m_widening_k = 0.0;
+	}
+
+	// Optionally share search nodes between histories with the same recent
+	// context (Default: no)
+	int transpositions;
+	getOption(options, "search-transpositions", 0, transpositions);
+	assert(0 <= transpositions);
+	m_transpositions = transpositions > 0 && !m_open_loop
+		? new TranspositionTable(transpositions) : NULL;
+
+	// Determine how the context trees compute their probabilities (Default:
+	// with log probabilities)
+	std::string ct_backend;
+	getOption(options, "ct-backend", std::string("log"), ct_backend);
+	bool ratio_backend;
+	if (ct_backend == "log") {
+		ratio_backend = false;
+	} else if (ct_backend == "ratio") {
+		ratio_backend = true;
+	} else {
+		std::cerr << "ERROR: Unknown ct-backend value: '" << ct_backend
+			<< "'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (ratio_backend && m_revert_to_snapshot) {
+		std::cerr << "ERROR: search-revert value 'snapshot' requires "
+			<< "ct-backend value 'log'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// Optionally store the top levels of the context trees in arrays, as
+	// many as fit in the given number of megabytes (Default: none)
+	double ct_dense_memory;
+	getOption(options, "ct-dense-memory", 0.0, ct_dense_memory);
+	assert(0.0 <= ct_dense_memory);
+	const size_t dense_memory = size_t(ct_dense_memory * 1024.0 * 1024.0);
+	if (dense_memory > 0 && (ratio_backend || m_revert_to_snapshot)) {
+		std::cerr << "ERROR: ct-dense-memory requires ct-backend value 'log' "
+			<< "and search-revert value 'root' or 'ancestor'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// Optionally predict symbols of several bits at once (Default: single
+	// bits). The symbols are parts of the fields of a cycle, in the order
+	// of the history: reward, observation and action.
+	int symbol_bits;
+	getOption(options, "ct-symbol-bits", 0, symbol_bits);
+	assert(0 <= symbol_bits && symbol_bits <= 16);
+	if (symbol_bits > 0
+			&& (ratio_backend || dense_memory > 0 || m_revert_to_snapshot)) {
+		std::cerr << "ERROR: ct-symbol-bits requires ct-backend value 'log', "
+			<< "ct-dense-memory value 0 and search-revert value 'root' or "
+			<< "'ancestor'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::vector<int> fields;
+	fields.push_back(env.rewardBits());
+	fields.push_back(env.observationBits());
+	fields.push_back(env.actionBits());
+
+	// Optionally use a separate context tree for each bit of a cycle, and
+	// learn the bits of a percept with several threads (Default: one tree)
+	int ct_factored;
+	getOption(options, "ct-factored", 0, ct_factored);
+	getOption(options, "ct-update-threads", 1, m_update_threads);
+	assert(1 <= m_update_threads);
+	if (ct_factored > 0 && (ratio_backend || dense_memory > 0
+			|| symbol_bits > 0 || m_revert_to_snapshot)) {
+		std::cerr << "ERROR: ct-factored requires ct-backend value 'log', "
+			<< "ct-dense-memory value 0, ct-symbol-bits value 0 and "
+			<< "search-revert value 'root' or 'ancestor'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (ct_factored == 0 && m_update_threads > 1) {
+		std::cerr << "ERROR: ct-update-threads requires ct-factored value 1"
+			<< std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// Create context tree, which is persistent if its versions are stored in
+	// the search tree
 	int ct_depth = getRequiredOption<int>(options, "ct-depth");
-	m_ct = new ContextTree(ct_depth);
+	m_shared_ct = NULL;
+	if (m_revert_to_snapshot)
+		m_ct = new PersistentContextTree(ct_depth);
+	else
+		m_ct = newContextTree(ct_depth, ratio_backend, dense_memory,
+		                      symbol_bits, ct_factored > 0 ? m_update_threads : 0,
+		                      fields);
+
+	// Optionally create a shallower context tree for playouts (Default: use
+	// the main context tree)
+	int rollout_ct_depth;
+	getOption(options, "rollout-ct-depth", 0, rollout_ct_depth);
+	assert(0 <= rollout_ct_depth);
+	m_rollout_ct = rollout_ct_depth > 0 ? newContextTree(rollout_ct_depth,
+		ratio_backend, dense_memory, symbol_bits, ct_factored > 0 ? 1 : 0,
+		fields) : NULL;
+
+	// Optionally compile the context trees once the learning period is over
+	// (Default: no)
+	int ct_freeze;
+	getOption(options, "ct-freeze", 0, ct_freeze);
+	m_freeze_model = ct_freeze > 0;
+	m_frozen_ct = NULL;
+	m_frozen_rollout_ct = NULL;
+	if (m_freeze_model && m_revert_to_snapshot) {
+		std::cerr << "ERROR: ct-freeze requires search-revert value 'root' "
+			<< "or 'ancestor'" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (m_freeze_model && ratio_backend) {
+		std::cerr << "ERROR: ct-freeze requires ct-backend value 'log'"
+			<< std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (m_freeze_model && (symbol_bits > 0 || ct_factored > 0)) {
+		std::cerr << "ERROR: ct-freeze requires ct-symbol-bits value 0 and "
+			<< "ct-factored value 0" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// Optionally split the search between several threads, each searching
+	// its own overlay over the model (Default: search in this thread)
+	getOption(options, "search-threads", 1, m_search_threads);
+	getOption(options, "search-check", 0, m_search_check);
+	assert(1 <= m_search_threads);
+	if (m_search_threads > 1) {
+		if (m_search_reuse != no_search_reuse) {
+			std::cerr << "ERROR: search-reuse requires search-threads value 1"
+				<< std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (m_revert_to_snapshot) {
+			std::cerr << "ERROR: search-revert value 'snapshot' requires "
+				<< "search-threads value 1" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (ratio_backend) {
+			std::cerr << "ERROR: ct-backend value 'ratio' requires "
+				<< "search-threads value 1" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (symbol_bits > 0 || ct_factored > 0) {
+			std::cerr << "ERROR: ct-symbol-bits and ct-factored require "
+				<< "search-threads value 1" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		m_worker_options = options;
+		m_worker_options["search-threads"] = "1";
+		m_worker_options["search-reuse"] = "tree";
+		for (int i = 0; i < m_search_threads; i++)
+			m_workers.push_back(new Agent(m_worker_options, env));
+	}
 
 	reset();
+
+	// Optionally learn a model shared with other agents (Default: the model
+	// is the agent's own). The agents search with overlays over the shared
+	// model, and learn into it from their own histories.
+	int shared_model_agents;
+	getOption(options, "shared-model-agents", 1, shared_model_agents);
+	assert(1 <= shared_model_agents);
+	if (shared_model_agents > 1) {
+		if (m_revert_to_snapshot || ratio_backend || dense_memory > 0
+				|| symbol_bits > 0 || ct_factored > 0 || m_freeze_model
+				|| m_rollout_ct != NULL) {
+			std::cerr << "ERROR: shared-model-agents requires ct-backend "
+				<< "value 'log', ct-dense-memory value 0, ct-symbol-bits value "
+				<< "0, ct-factored value 0, ct-freeze value 0, "
+				<< "rollout-ct-depth value 0 and search-revert value 'root' or "
+				<< "'ancestor'" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (m_search_threads > 1) {
+			std::cerr << "ERROR: shared-model-agents requires search-threads "
+				<< "value 1" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		delete m_ct;
+		m_shared_ct = new SharedContextTree(ct_depth);
+		m_ct = new OverlayContextTree(*m_shared_ct);
+	}
 }
 
 
 // destroy the agent and the corresponding context tree
 Agent::~Agent(void) {
+	stopPondering();
+	if (m_search_tree)
+		SearchNode::release(m_search_tree);
 	if (m_ct)
 		delete m_ct;
+	if (m_rollout_ct)
+		delete m_rollout_ct;
+	if (m_shared_ct)
+		delete m_shared_ct;
+	if (m_transpositions)
+		delete m_transpositions;
+	for (size_t i = 0; i < m_workers.size(); i++)
+		delete m_workers[i];
 }
 
 
@@ -71,6 +486,14 @@ int Agent::modelSize() const {
 }
 
 
+// Workers collect metrics too, as their statistics are combined
+void Agent::collectMetrics(const bool collect) {
+	m_collect_metrics = collect;
+	for (size_t i = 0; i < m_workers.size(); i++)
+		m_workers[i]->collectMetrics(collect);
+}
+
+
 // generate an action uniformly at random
 action_t Agent::genRandomAction(void) const {
 	return randRange(m_env.maxAction() + 1);
@@ -121,11 +544,55 @@ void Agent::modelUpdate(percept_t observation, percept_t reward) {
 	// Update internal model
 	symbol_list_t percept_syms;
 	encodePercept(percept_syms, observation, reward);
-	if(m_learning_period > 0 && m_time_cycle > m_learning_period)
+	const bool learn = !(m_learning_period > 0
+		&& m_time_cycle > m_learning_period);
+	if (!learn && m_freeze_model && m_frozen_ct == NULL)
+		freezeModel();
+	if (m_rollout_ct != NULL) {
+		// Catch up with the actions since the last percept
+		symbol_list_t const& history = m_ct->history();
+		for (size_t i = m_rollout_ct->historySize(); i < history.size(); i++)
+			m_rollout_ct->updateHistory(history[i]);
+		if (learn)
+			m_rollout_ct->update(percept_syms);
+		else
+			m_rollout_ct->updateHistory(percept_syms);
+	}
+	if (m_shared_ct != NULL) {
+		// Catch up with the actions since the last percept, then learn into
+		// the shared model, which the overlay reads
+		symbol_list_t const& history = m_ct->history();
+		for (size_t i = m_shared_ct->historySize(); i < history.size(); i++)
+			m_shared_ct->updateHistory(history[i]);
+		if (learn)
+			m_shared_ct->update(percept_syms);
+		else
+			m_shared_ct->updateHistory(percept_syms);
+		m_ct->updateHistory(percept_syms);
+	}
+	else if (!learn)
 		m_ct->updateHistory(percept_syms); // Update but don't learn
+	else if (m_update_threads > 1)
+		factoredModel()->updateInParallel(percept_syms); // Learn in parallel
 	else
 		m_ct->update(percept_syms); // Update and learn
 
+	// Keep the part of the search tree that follows this percept. Its percept
+	// distributions were computed before the model learnt from the percept.
+	if (m_search_tree != NULL && m_search_tree->type() != chance) {
+		SearchNode::release(m_search_tree);
+		m_search_tree = NULL;
+	}
+	advanceSearchTree(perceptIndex(observation, reward));
+	if (m_search_tree != NULL)
+		m_search_tree->clearPerceptCaches();
+
+	// Update the reward estimates for truncated playouts
+	m_reward_average.add(reward);
+	if (m_playout_value == percept_playout_value && m_last_percept >= 0)
+		m_percept_value[m_last_percept].add(reward);
+	m_last_percept = perceptCode(observation, reward);
+
 	// Update other properties
 	m_total_reward += reward;
 	m_last_update = percept_update;
@@ -169,14 +636,55 @@ void Agent::modelRevert(const ModelUndo &mu) {
 }
 
 
+// Restore a version of the model, along with the history and the attributes
+// of the agent at the time the version was retained
+void Agent::restoreModel(ct_version_t version, const ModelUndo &mu) {
+	m_ct->revertHistory(historySize() - mu.historySize());
+	persistentModel()->restoreVersion(version);
+	m_time_cycle = mu.age();
+	m_total_reward = mu.reward();
+	m_last_update = mu.lastUpdate();
+}
+
+
+// The model as a persistent context tree
+PersistentContextTree *Agent::persistentModel(void) const {
+	assert(m_revert_to_snapshot);
+	return static_cast<PersistentContextTree*>(m_ct);
+}
+
+
+// The model, if it is factored
+FactoredContextTree *Agent::factoredModel(void) const {
+	assert(m_update_threads > 1);
+	return static_cast<FactoredContextTree*>(m_ct);
+}
+
+
 void Agent::reset(void) {
 	m_ct->clear();
+	m_reward_average = reward_average_t();
+	m_percept_value.clear();
+	m_last_percept = -1;
+	if (m_rollout_ct)
+		m_rollout_ct->clear();
 	m_time_cycle = 0;
 	m_total_reward = 0.0;
 	m_last_update = action_update;
 }
 
 
+// Replace the agent's own model by a view of the owner's shared model
+void Agent::shareModel(Agent const& owner) {
+	assert(m_shared_ct != NULL && owner.m_shared_ct != NULL);
+	assert(historySize() == 0);
+	delete m_ct;
+	delete m_shared_ct;
+	m_shared_ct = new SharedContextTree(*owner.m_shared_ct);
+	m_ct = new OverlayContextTree(*m_shared_ct);
+}
+
+
 // probability of selecting an action according to the
 // agent's internal model of it's own behaviour
 double Agent::getPredictedActionProb(const action_t action) {
@@ -208,17 +716,116 @@ double Agent::perceptProbability(const percept_t observation, const percept_t re
 
 // Use rhoUCT to search for next action.
 action_t Agent::search(void) {
+	if (!m_workers.empty())
+		return parallelSearch();
+
 	// Save the agent's current state
 	ModelUndo undo = ModelUndo(*this);
+	if (m_revert_to_snapshot)
+		m_root_version = persistentModel()->retainVersion();
+
+	m_search_stats = search_stats_t();
+	if (m_collect_metrics)
+		m_metrics = &m_search_stats;
+	const size_t ct_nodes = m_collect_metrics ? m_ct->size() : 0;
+	const size_t ct_nodes_created = m_ct->nodesCreated();
+
+	// Create a new search tree, unless the subtree of the previous search
+	// for the actual action and percept has been kept
+	if (m_search_tree == NULL) {
+		m_search_tree = new SearchNode(decision);
+		m_search_tree->retain();
+		m_search_nodes = 1;
+	} else {
+		m_search_nodes = int(m_search_tree->size());
+	}
 
-	// Create a new search tree
-	m_search_tree = new SearchNode(decision);
 
+	// Main sampling loop. Without a time budget, conduct a fixed number of
+	// simulations. Otherwise keep sampling until the deadline has passed,
+	// subject to the minimum and maximum number of simulations.
+	typedef std::chrono::steady_clock search_clock;
+	const search_clock::time_point start = search_clock::now();
+	const search_clock::time_point deadline = start
+		+ std::chrono::milliseconds(m_search_time_ms);
+
+	// The simulation budget if it is known in advance, otherwise -1.
+	int budget = -1;
+	if (m_search_time_ms == 0)
+		budget = m_mc_simulations;
+	else if (m_search_max_simulations > 0)
+		budget = std::max(m_search_min_simulations, m_search_max_simulations);
+
+	int t = 0;
+	for ( ; ; t++) {
+		if (m_search_time_ms == 0) {
+			if (t >= m_mc_simulations)
+				break;
+		} else if (t >= m_search_min_simulations) {
+			if (m_search_max_simulations > 0 && t >= m_search_max_simulations)
+				break;
+			if (search_clock::now() >= deadline)
+				break;
+		}
+
+		// Periodically check whether the decision at the root has converged
+		if (m_search_stop_interval > 0 && t > 0
+				&& t % m_search_stop_interval == 0
+				&& searchConverged(budget < 0 ? -1 : budget - t)) {
+			break;
+		}
 
-	// Main sampling loop
-	for (int t = 0; t < m_mc_simulations; t++) {
+		m_simulation_depth = 0;
 		m_search_tree->sample(*this, m_horizon);
+		m_search_stats.depth_mean += m_simulation_depth;
+		m_search_stats.depth_max = std::max(m_search_stats.depth_max,
+		                                    m_simulation_depth);
+
+		// Begin the next simulation at the root of the search tree. When
+		// reverting to the shared ancestor, the model is left as it is until
+		// the next simulation needs it (see Agent::syncModel()).
+		if (m_revert_to_ancestor) {
+			m_simulation_path.clear();
+			m_simulation_caches.clear();
+			m_model_shared = 0;
+		} else {
+			ScopeTimer timer(m_metrics ? &m_metrics->time_revert : NULL);
+			modelRevert(undo);
+		}
+	}
+
+	// Revert the model to the root of the search tree
+	if (m_revert_to_snapshot) {
+		ScopeTimer timer(m_metrics ? &m_metrics->time_revert : NULL);
+		restoreModel(m_root_version, undo);
+		PersistentContextTree::releaseVersion(m_root_version);
+		m_root_version = NULL;
+		m_model_path.clear();
+	} else if (m_revert_to_ancestor) {
+		ScopeTimer timer(m_metrics ? &m_metrics->time_revert : NULL);
 		modelRevert(undo);
+		m_model_path.clear();
+	}
+
+	if (m_metrics) {
+		// The time not spent on the model is spent on selection
+		std::chrono::duration<double> elapsed = search_clock::now() - start;
+		m_search_stats.time_selection = elapsed.count()
+			- m_search_stats.time_sampling - m_search_stats.time_playout
+			- m_search_stats.time_revert;
+		m_search_stats.depth_mean /= std::max(1, t);
+		m_search_stats.ct_nodes_created =
+			m_ct->nodesCreated() - ct_nodes_created;
+		m_search_stats.ct_nodes_freed = m_search_stats.ct_nodes_created
+			- (long long)(m_ct->size()) + (long long)(ct_nodes);
+		m_metrics = NULL;
+	}
+	m_search_stats.simulations = t;
+	m_search_stats.simulations_saved = budget < 0 ? 0 : std::max(0, budget - t);
+	m_search_stats.nodes = m_search_nodes;
+	if (m_transpositions) {
+		m_search_stats.transposition_lookups = m_transpositions->lookups();
+		m_search_stats.transposition_hits = m_transpositions->hits();
 	}
 
 	// Determine best action using tree constructed during sampling
@@ -237,32 +844,675 @@ action_t Agent::search(void) {
 		}
 	}
 
-	delete m_search_tree;
+	// Keep the search tree for the next cycle if it is reused
+	if (m_search_reuse == no_search_reuse) {
+		SearchNode::release(m_search_tree);
+		m_search_tree = NULL;
+	}
+	if (m_transpositions)
+		m_transpositions->clear();
 
 	return best_action;
 }
 
 
+// Search with several threads. Each worker searches its own overlay over the
+// model with its share of the simulations and its own stream of random
+// numbers. The statistics of the actions at the roots of the workers' search
+// trees are then combined in a fixed order, so the result only depends on the
+// random seed and the number of threads.
+action_t Agent::parallelSearch(void) {
+	const unsigned int seed = unsigned(rand());
+
+	std::vector<visits_t> visits;
+	std::vector<double> means;
+	runWorkers(seed, visits, means);
+
+	// Check that the search is reproducible
+	if (m_search_check) {
+		std::vector<visits_t> check_visits;
+		std::vector<double> check_means;
+		runWorkers(seed, check_visits, check_means);
+		if (check_visits != visits || check_means != means) {
+			std::cerr << "ERROR: Repeated search in cycle " << age()
+				<< " gave a different result" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Determine best action as in Agent::search()
+	action_t best_action = genRandomAction();
+	double best_mean = -1;
+
+	for (action_t a = 0; a <= maxAction(); a++) {
+		if (visits[a] == 0)
+			continue;
+
+		double mean = means[a] + rand01() * 0.0001;
+		if (mean > best_mean) {
+			best_mean = mean;
+			best_action = a;
+		}
+	}
+
+	return best_action;
+}
+
+
+// Run a search in every worker and combine the visits to and mean reward of
+// each action at the roots of their search trees
+void Agent::runWorkers(unsigned int seed, std::vector<visits_t> &visits,
+		std::vector<double> &means) {
+	std::vector<std::thread> threads;
+	for (int i = 0; i < m_search_threads; i++) {
+		Agent *worker = m_workers[i];
+		worker->copyModel(*this);
+		worker->m_mc_simulations = m_mc_simulations / m_search_threads
+			+ (i < m_mc_simulations % m_search_threads ? 1 : 0);
+		threads.push_back(std::thread([worker, seed, i]() {
+			setThreadRandomStream(seed, unsigned(i));
+			worker->search();
+			clearThreadRandomStream();
+		}));
+	}
+	for (int i = 0; i < m_search_threads; i++)
+		threads[i].join();
+
+	m_search_stats = search_stats_t();
+	visits.assign(maxAction() + 1, 0);
+	means.assign(maxAction() + 1, 0.0);
+	for (int i = 0; i < m_search_threads; i++) {
+		Agent *worker = m_workers[i];
+		m_search_stats.add(worker->m_search_stats);
+		for (action_t a = 0; a <= maxAction(); a++) {
+			SearchNode *n = worker->m_search_tree->child(a);
+			if (n == NULL || n->visits() == 0)
+				continue;
+			visits[a] += n->visits();
+			means[a] += n->visits() * n->expectation();
+		}
+		SearchNode::release(worker->m_search_tree);
+		worker->m_search_tree = NULL;
+	}
+	for (action_t a = 0; a <= maxAction(); a++) {
+		if (visits[a] > 0)
+			means[a] /= double(visits[a]);
+	}
+}
+
+
+// Base the agent's model on another agent's model. The context trees are
+// shared through overlays rather than copied, unless they are frozen.
+void Agent::copyModel(Agent const& other) {
+	followContextTree(m_ct, m_frozen_ct, *other.m_ct, other.m_frozen_ct);
+	if (m_rollout_ct) {
+		followContextTree(m_rollout_ct, m_frozen_rollout_ct,
+		                  *other.m_rollout_ct, other.m_frozen_rollout_ct);
+	}
+	m_time_cycle = other.m_time_cycle;
+	m_total_reward = other.m_total_reward;
+	m_last_update = other.m_last_update;
+	m_reward_average = other.m_reward_average;
+	m_percept_value = other.m_percept_value;
+	m_last_percept = other.m_last_percept;
+}
+
+
+// Compile the context trees, which replace the originals. From then on only
+// their histories are updated, except during the search.
+void Agent::freezeModel(void) {
+	m_frozen_ct = new FrozenContextTree(*m_ct);
+	delete m_ct;
+	m_ct = m_frozen_ct;
+	if (m_rollout_ct) {
+		m_frozen_rollout_ct = new FrozenContextTree(*m_rollout_ct);
+		delete m_rollout_ct;
+		m_rollout_ct = m_frozen_rollout_ct;
+	}
+}
+
+
+// Perform an action during a simulation
+void Agent::simulateAction(action_t action) {
+	ScopeTimer timer(m_metrics ? &m_metrics->time_sampling : NULL);
+	m_simulation_depth++;
+	if (m_revert_to_ancestor)
+		pushSimulationStep(action);
+	else
+		modelUpdate(action);
+}
+
+
+// Generate a percept at a chance node during a simulation. Unless percept
+// caching is disabled, percepts are sampled from the distribution stored at
+// the chance node, which is only valid if the model is in the same state on
+// every visit to the chance node. Its children are therefore indexed by the
+// whole percept rather than just the observation.
+//
+// When reverting to the shared ancestor, the model may be ahead of the chance
+// node. It is brought up to date with the chance node only when a percept bit
+// prediction is missing, in which case it is also updated with the rest of
+// the percept.
+interaction_t Agent::simulatePercept(PerceptCache &cache, percept_t &o,
+		percept_t &r) {
+	ScopeTimer timer(m_metrics ? &m_metrics->time_sampling : NULL);
+	if (m_percept_cache == no_percept_cache) {
+		genPerceptAndUpdate(o, r);
+		return perceptIndex(o, r);
+	}
+
+	const int bits = m_env.perceptBits();
+	bool synced = !m_revert_to_ancestor; // Is the model at the chance node?
+	if (m_revert_to_snapshot)
+		m_simulation_caches.push_back(&cache);
+
+	// Compute the whole percept distribution once the lazily computed percept
+	// bit predictions cover half of it, so that computing the rest costs no
+	// more than has already been spent.
+	if (m_percept_cache == alias_percept_cache && !cache.complete()
+			&& bits <= m_percept_enumerate_bits
+			&& 2 * cache.predictions() >= (size_t(1) << bits) - 1) {
+		if (!synced) {
+			syncModel();
+			synced = true;
+		}
+		std::vector<interaction_t> percepts;
+		std::vector<double> probabilities;
+		symbol_list_t prefix;
+		enumeratePercepts(prefix, 1.0, percepts, probabilities);
+		cache.setDistribution(percepts, probabilities);
+	}
+
+	symbol_list_t percept_syms;
+	int applied = 0; // The number of percept bits the model includes
+	if (cache.complete()) {
+		encode(percept_syms, cache.sample(), bits);
+	} else {
+		percept_syms.resize(bits);
+		unsigned int prefix = 1;
+		for (int i = 0; i < bits; i++) {
+			double p;
+			if (!cache.find(prefix, p)) {
+				if (!synced) {
+					syncModel();
+					synced = true;
+				}
+				for ( ; applied < i; applied++)
+					m_ct->update(percept_syms[applied]);
+				p = m_ct->predict(true);
+				cache.store(prefix, p);
+			}
+
+			percept_syms[i] = rand01() < p;
+			prefix = 2 * prefix + (percept_syms[i] ? 1 : 0);
+		}
+	}
+	decodePercept(percept_syms, o, r);
+	const interaction_t code = perceptCode(o, r);
+
+	if (!synced) {
+		pushSimulationStep(code);
+		return code;
+	}
+
+	// Update the model with the rest of the percept
+	for ( ; applied < bits; applied++)
+		m_ct->update(percept_syms[applied]);
+	m_total_reward += r;
+	m_last_update = percept_update;
+
+	if (m_revert_to_ancestor) {
+		m_model_path.push_back(code);
+		m_simulation_path.push_back(code);
+		m_model_shared++;
+	}
+	return code;
+}
+
+
+// Check whether a chance node may have another child under progressive
+// widening, i.e. whether it has fewer than k (n + 1)^alpha children after n
+// visits
+bool Agent::admitPercept(size_t children, visits_t visits) const {
+	return m_widening_k == 0.0 || children == 0
+		|| double(children) < m_widening_k
+		   * std::pow(double(visits + 1), m_widening_alpha);
+}
+
+
+// The number of actions considered by a decision node visited a number of
+// times: k (n + 1)^alpha rounded up, or all actions without action widening
+int Agent::actionsConsidered(visits_t visits) const {
+	if (m_action_widening_k == 0.0)
+		return maxAction() + 1;
+	const double considered = std::ceil(m_action_widening_k
+		* std::pow(double(visits + 1), m_action_widening_alpha));
+	return int(std::min(considered, double(maxAction() + 1)));
+}
+
+
+// Receive a percept that was generated at a previous visit to the chance node
+void Agent::simulateKnownPercept(PerceptCache &cache, interaction_t code,
+		percept_t &o, percept_t &r) {
+	ScopeTimer timer(m_metrics ? &m_metrics->time_sampling : NULL);
+	o = code >> m_env.rewardBits();
+	r = code & ((interaction_t(1) << m_env.rewardBits()) - 1);
+
+	if (m_revert_to_snapshot)
+		m_simulation_caches.push_back(&cache);
+	if (m_revert_to_ancestor) {
+		pushSimulationStep(code);
+		return;
+	}
+
+	symbol_list_t percept_syms;
+	encodePercept(percept_syms, o, r);
+	m_ct->update(percept_syms);
+	m_total_reward += r;
+	m_last_update = percept_update;
+}
+
+
+// Compute the probability of every percept that starts with the given bits.
+// The model is left in the same state.
+void Agent::enumeratePercepts(symbol_list_t &prefix, double probability,
+		std::vector<interaction_t> &percepts,
+		std::vector<double> &probabilities) {
+	if (int(prefix.size()) == m_env.perceptBits()) {
+		percepts.push_back(decode(prefix, prefix.size()));
+		probabilities.push_back(probability);
+		return;
+	}
+
+	const double p = m_ct->predict(true);
+	for (int sym = 0; sym <= 1; sym++) {
+		prefix.push_back(sym == 1);
+		m_ct->update(prefix.back());
+		enumeratePercepts(prefix, probability * (sym == 1 ? p : 1.0 - p),
+		                  percepts, probabilities);
+		m_ct->revert();
+		prefix.pop_back();
+	}
+}
+
+
+// Estimate the future reward at a leaf of the search tree
+reward_t Agent::simulatePlayout(int horizon) {
+	ScopeTimer timer(m_metrics ? &m_metrics->time_playout : NULL);
+	if (!m_revert_to_ancestor)
+		return playout(horizon);
+
+	// Bring the model up to date with the leaf, and return it to the leaf
+	// once the playout is complete
+	syncModel();
+	ModelUndo undo = ModelUndo(*this);
+	if (!m_revert_to_snapshot) {
+		reward_t reward = playout(horizon);
+		modelRevert(undo);
+		return reward;
+	}
+	ct_version_t version = persistentModel()->retainVersion();
+	reward_t reward = playout(horizon);
+	restoreModel(version, undo);
+	PersistentContextTree::releaseVersion(version);
+	return reward;
+}
+
+
+// Index of a percept among the children of a chance node. In an open loop,
+// chance nodes have a single child.
+interaction_t Agent::perceptIndex(percept_t observation, percept_t reward) const {
+	if (m_open_loop)
+		return 0;
+	if (m_percept_cache == no_percept_cache && m_widening_k == 0.0)
+		return observation;
+	return perceptCode(observation, reward);
+}
+
+
+// Move the root of a kept search tree to one of its children
+void Agent::advanceSearchTree(interaction_t index) {
+	if (m_search_tree == NULL)
+		return;
+
+	SearchNode *next = m_search_tree->child(index);
+	if (next != NULL)
+		next->retain();
+	SearchNode::release(m_search_tree);
+	m_search_tree = next;
+}
+
+
+// Keep the search tree below the performed action, and start searching it in
+// the background if pondering
+void Agent::ponder(action_t action) {
+	assert(m_last_update == action_update);
+
+	m_search_stats.simulations_pondered = 0;
+	if (m_search_tree != NULL && m_search_tree->type() != decision) {
+		SearchNode::release(m_search_tree);
+		m_search_tree = NULL;
+	}
+	advanceSearchTree(action);
+	if (m_search_tree == NULL || m_search_reuse != ponder_search_reuse)
+		return;
+
+	m_ponder_stop = false;
+	m_ponder_thread = std::thread(&Agent::ponderLoop, this, unsigned(rand()));
+}
+
+
+// Stop searching in the background
+void Agent::stopPondering(void) {
+	if (!m_ponder_thread.joinable())
+		return;
+
+	m_ponder_stop = true;
+	m_ponder_thread.join();
+	if (m_transpositions)
+		m_transpositions->clear();
+}
+
+
+// Sample from the chance node below the performed action until told to stop.
+// The thread draws its own random numbers, as rand() is not thread-safe and
+// the main thread keeps using it.
+void Agent::ponderLoop(unsigned int seed) {
+	setThreadRandomStream(seed, 0);
+	ModelUndo undo = ModelUndo(*this);
+	int simulations = 0;
+	while (!m_ponder_stop) {
+		m_search_tree->sample(*this, m_horizon);
+		modelRevert(undo);
+		simulations++;
+	}
+	m_search_stats.simulations_pondered = simulations;
+	clearThreadRandomStream();
+}
+
+
+// Check whether the node budget allows another node to be created
+bool Agent::canExpand(void) const {
+	return m_search_max_nodes == 0 || m_search_nodes < m_search_max_nodes;
+}
+
+
+// Create a search node, or find the node of a transposition. The key combines
+// the recent context with the node's type and remaining horizon, so a node is
+// never shared between different depths of the search tree.
+SearchNode *Agent::newSearchNode(nodetype_t type, int horizon) {
+	if (m_transpositions == NULL) {
+		m_search_nodes++;
+		if (m_metrics)
+			m_metrics->nodes_created++;
+		return new SearchNode(type);
+	}
+
+	if (m_revert_to_ancestor)
+		syncModel();
+	context_hash_t key = m_ct->contextHash();
+	key ^= (context_hash_t(horizon) << 1 | (type == decision ? 1 : 0))
+		* 0x9e3779b97f4a7c15ULL;
+
+	SearchNode *node = m_transpositions->find(key);
+	if (node == NULL) {
+		node = new SearchNode(type);
+		m_transpositions->insert(key, node);
+		m_search_nodes++;
+		if (m_metrics)
+			m_metrics->nodes_created++;
+	}
+	return node;
+}
+
+
+// Append an action or percept to the current simulation's path
+void Agent::pushSimulationStep(interaction_t step) {
+	if (m_model_shared == m_simulation_path.size()
+			&& m_model_shared < m_model_path.size()
+			&& m_model_path[m_model_shared] == step) {
+		m_model_shared++;
+	}
+	m_simulation_path.push_back(step);
+}
+
+
+// Revert the model to the deepest node shared by the previous and current
+// simulation, then update it with the remainder of the current simulation.
+// Steps alternate between actions (even indices) and percepts (odd indices).
+// With versions of the model stored in the search tree, nothing needs to be
+// reverted (see Agent::restoreSimulationVersion()), and a version is stored
+// at each chance node that the model passes.
+void Agent::syncModel(void) {
+	if (m_revert_to_snapshot)
+		restoreSimulationVersion();
+
+	while (m_model_path.size() > m_model_shared) {
+		if (m_model_path.size() % 2 == 1)
+			m_ct->revertHistory(m_env.actionBits());
+		else
+			m_ct->revert(m_env.perceptBits());
+		m_model_path.pop_back();
+	}
+
+	symbol_list_t syms;
+	for (size_t i = m_model_shared; i < m_simulation_path.size(); i++) {
+		const interaction_t step = m_simulation_path[i];
+		if (i % 2 == 0) {
+			encodeAction(syms, step);
+			m_ct->updateHistory(syms);
+			if (m_revert_to_snapshot && i / 2 < m_simulation_caches.size()
+					&& m_simulation_caches[i / 2]->modelVersion() == NULL) {
+				m_simulation_caches[i / 2]->setModelVersion(
+					persistentModel()->retainVersion());
+			}
+		} else {
+			syms.clear();
+			encode(syms, step, m_env.perceptBits());
+			m_ct->update(syms);
+		}
+		m_model_path.push_back(step);
+	}
+	m_model_shared = m_simulation_path.size();
+
+	m_last_update = m_model_path.size() % 2 == 1 ? action_update : percept_update;
+}
+
+
+// Restore the version of the model stored at the deepest chance node of the
+// current simulation that has one, or at the root of the search tree. The
+// chance node below the k-th action (counting from 0) follows the first
+// 2k + 1 steps. The model is left alone if it is already on the path of the
+// current simulation and at least as deep.
+void Agent::restoreSimulationVersion(void) {
+	size_t k = m_simulation_caches.size();
+	while (k > 0 && m_simulation_caches[k - 1]->modelVersion() == NULL)
+		k--;
+	const size_t steps = k > 0 ? 2 * k - 1 : 0;
+	if (m_model_path.size() == m_model_shared && steps <= m_model_shared)
+		return;
+
+	// Bring the history up to date with the chance node
+	const size_t shared = std::min(m_model_shared, steps);
+	for (size_t i = m_model_path.size(); i > shared; i--) {
+		m_ct->revertHistory(i % 2 == 1 ? m_env.actionBits()
+		                               : m_env.perceptBits());
+	}
+	symbol_list_t syms;
+	for (size_t i = shared; i < steps; i++) {
+		if (i % 2 == 0) {
+			encodeAction(syms, m_simulation_path[i]);
+		} else {
+			syms.clear();
+			encode(syms, m_simulation_path[i], m_env.perceptBits());
+		}
+		m_ct->updateHistory(syms);
+	}
+
+	persistentModel()->restoreVersion(k > 0
+		? m_simulation_caches[k - 1]->modelVersion() : m_root_version);
+	m_model_path.assign(m_simulation_path.begin(),
+	                    m_simulation_path.begin() + steps);
+	m_model_shared = steps;
+}
+
+
+// Encode a percept as a single integer. The reward occupies the least
+// significant bits, as it comes first in Agent::encodePercept().
+interaction_t Agent::perceptCode(percept_t observation, percept_t reward) const {
+	return reward + (observation << m_env.rewardBits());
+}
+
+
+// Check whether further sampling could change the action chosen at the root
+// of the search tree.
+bool Agent::searchConverged(int remaining) const {
+	// Every simulation returns a reward between 0 and range.
+	const double range = m_horizon * maxReward();
+
+	// Find the action with the best expected reward.
+	SearchNode *best = NULL;
+	for (action_t a = 0; a <= maxAction(); a++) {
+		SearchNode *n = m_search_tree->child(a);
+		if (n && (best == NULL || n->expectation() > best->expectation()))
+			best = n;
+	}
+	if (best == NULL)
+		return false;
+
+	bool overtakable = remaining < 0;
+	bool separated = m_search_stop_delta > 0.0;
+	const double log_delta = std::log(2.0 / m_search_stop_delta);
+	const double best_visits = double(best->visits());
+	const double best_mean = best->expectation();
+
+	for (action_t a = 0; a <= maxAction(); a++) {
+		SearchNode *n = m_search_tree->child(a);
+		if (n == best)
+			continue;
+
+		const double visits = n ? double(n->visits()) : 0.0;
+		const double mean = n ? n->expectation() : 0.0;
+
+		// Could the remaining simulations raise this action's expected reward
+		// above the lowest expected reward the best action could drop to?
+		if (!overtakable) {
+			const double r = double(remaining);
+			const double upper = (mean * visits + r * range) / (visits + r);
+			const double lower = best_mean * best_visits / (best_visits + r);
+			if (visits + r > 0.0 && upper >= lower)
+				overtakable = true;
+		}
+
+		// Do the Hoeffding confidence intervals of the two actions overlap?
+		if (separated) {
+			if (visits == 0.0) {
+				separated = false;
+			} else {
+				const double best_width =
+					range * std::sqrt(log_delta / (2.0 * best_visits));
+				const double width = range * std::sqrt(log_delta / (2.0 * visits));
+				if (best_mean - best_width <= mean + width)
+					separated = false;
+			}
+		}
+	}
+
+	return !overtakable || separated;
+}
+
+
 // Agent's playout policy. Generate percepts from context tree and choose
-// actions uniformly at random.
+// actions uniformly at random. If the playout is truncated, the reward of the
+// remaining cycles is estimated instead.
 reward_t Agent::playout(int horizon) {
+	const int steps = m_playout_depth > 0 && m_playout_depth < horizon
+		? m_playout_depth : horizon;
+	interaction_t last_percept = m_last_percept;
 
 	reward_t reward = 0.0;
-	while (horizon-- > 0) {
+	if (m_rollout_ct != NULL) {
+		reward = rolloutModelPlayout(steps, last_percept);
+	} else {
+		for (int i = 0; i < steps; i++) {
+			// Execute an action chosen uniformly at random.
+			action_t a = genRandomAction();
+			modelUpdate(a);
+
+			// Sample a percept.
+			percept_t o, r;
+			genPerceptAndUpdate(o, r);
+			reward += r;
+			last_percept = perceptCode(o, r);
+		}
+	}
+
+	if (m_metrics)
+		m_metrics->playout_steps += steps;
+	if (steps < horizon)
+		reward += reward_t(horizon - steps) * estimateReward(last_percept);
+	return reward;
+}
+
+
+// Playout using the rollout context tree. The rollout model's history only
+// follows the real interaction, so it is first brought up to date with the
+// simulated history. The main model is not changed.
+reward_t Agent::rolloutModelPlayout(int horizon,
+		interaction_t &last_percept) {
+	symbol_list_t const& history = m_ct->history();
+	const size_t catch_up = history.size() - m_rollout_ct->historySize();
+	for (size_t i = m_rollout_ct->historySize(); i < history.size(); i++)
+		m_rollout_ct->updateHistory(history[i]);
+
+	reward_t reward = 0.0;
+	symbol_list_t action_syms, percept_syms;
+	for (int i = 0; i < horizon; i++) {
 		// Execute an action chosen uniformly at random.
-		action_t a = genRandomAction();
-		modelUpdate(a);
+		encodeAction(action_syms, genRandomAction());
+		m_rollout_ct->updateHistory(action_syms);
 
 		// Sample a percept.
 		percept_t o, r;
-		genPerceptAndUpdate(o, r);
+		m_rollout_ct->genRandomSymbolsAndUpdate(percept_syms,
+		                                        m_env.perceptBits());
+		decodePercept(percept_syms, o, r);
 		reward += r;
+		last_percept = perceptCode(o, r);
+	}
+
+	// Return the rollout model to the real history
+	for (int i = 0; i < horizon; i++) {
+		m_rollout_ct->revert(m_env.perceptBits());
+		m_rollout_ct->revertHistory(m_env.actionBits());
 	}
+	m_rollout_ct->revertHistory(int(catch_up));
 
 	return reward;
 }
 
 
+// Estimate the reward of a cycle following a percept, by the average reward
+// that followed the percept in the real interaction (if enabled and known) or
+// the average reward of all cycles
+reward_t Agent::estimateReward(interaction_t percept) const {
+	if (m_playout_value == percept_playout_value) {
+		std::map<interaction_t, reward_average_t>::const_iterator it =
+			m_percept_value.find(percept);
+		if (it != m_percept_value.end())
+			return it->second.mean;
+	}
+	return m_reward_average.mean;
+}
+
+
+// Add a reward to a running average
+void Agent::reward_average_t::add(reward_t reward) {
+	count++;
+	mean += (reward - mean) / reward_t(count);
+}
+
+
 // Encodes an action as a list of symbols
 void Agent::encodeAction(symbol_list_t &symbols, action_t action) const {
 	symbols.clear();
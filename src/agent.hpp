@@ -1,19 +1,39 @@
 #ifndef __AGENT_HPP__
 #define __AGENT_HPP__
 
+#include <atomic>
 #include <iostream>
+#include <thread>
 //#include <queue>
 #include "environment.hpp"
 #include "main.hpp"
+#include "search.hpp"
 
 class ContextTree;
 
+class FrozenContextTree;
+
+class FactoredContextTree;
+
+class SharedContextTree;
+
 class SearchNode;
 
 class ModelUndo;
 
 enum update_t {action_update, percept_update};
 
+/** How percept distributions are stored at the chance nodes of the search
+ * tree (see PerceptCache). */
+enum percept_cache_t {no_percept_cache, lazy_percept_cache, alias_percept_cache};
+
+/** How the reward of the cycles beyond a truncated playout is estimated (see
+ * Agent::estimateReward()). */
+enum playout_value_t {average_playout_value, percept_playout_value};
+
+/** Whether the search tree is kept between cycles (see Agent::ponder()). */
+enum search_reuse_t {no_search_reuse, tree_search_reuse, ponder_search_reuse};
+
 /** The ::Agent class represents a MC-AIXI-CTW agent.  It includes much of the
  * high-level logic for choosing suitable actions. In particular, the agent
  * maintains an internal model of the environment using a context tree
@@ -33,8 +53,12 @@ enum update_t {action_update, percept_update};
  * high-level search function and a playout policy:
  *  - Agent::search()
  *  - Agent::playout()
+ *  - Agent::simulateAction()
+ *  - Agent::simulatePercept()
+ *  - Agent::simulatePlayout()
  *  - Agent::m_horizon
  *  - Agent::m_mc_simulations
+ *  - Agent::m_search_time_ms
  *  - Agent::m_search_tree
  *
  * Several functions decode/encode actions and percepts between the
@@ -140,6 +164,16 @@ public:
 	/** Resets the agent and clears the context tree. */
 	void reset(void);
 
+	/** Learn the model of another agent from now on, instead of a model of
+	 * its own. Both agents must have been created with the
+	 * shared-model-agents option. Each agent keeps its own history, and
+	 * learns its percepts into the shared model (see ::SharedContextTree).
+	 * Agents sharing a model may learn at the same time, but none may
+	 * search while another learns.
+	 * \param owner The agent whose model is shared. It must outlive this
+	 *     agent. */
+	void shareModel(Agent const& owner);
+
 	/** Probability of selecting an action according to the
 	 * agent's internal model of it's own behaviour.
 	 * \param action The action we wish to find the likelihood of.
@@ -160,6 +194,19 @@ public:
 	 * \return The best action as determined by the sampling. */
 	action_t search(void);
 
+	/** Prepare for the next cycle after performing an action. If the search
+	 * tree is kept between cycles (search-reuse option), its root moves to
+	 * the chance node below the action. With pondering, the agent then keeps
+	 * sampling from that chance node in a background thread until
+	 * Agent::stopPondering() is called. The agent must not be used in the
+	 * meantime.
+	 * \param action The action that was performed, after the model has been
+	 *     updated with it. */
+	void ponder(action_t action);
+
+	/** Stop the background search started by Agent::ponder(), if any. */
+	void stopPondering(void);
+
 	/** Simulate agent/enviroment interaction for a specified amount of steps
 	 * where agent actions are chosen uniformly at random and percepts are generated
 	 * from the agents environment model.
@@ -168,8 +215,204 @@ public:
 	 * \return The total reward from the simulation. */
 	reward_t playout(int horizon);
 
+	/** Simulate agent/environment interaction like Agent::playout(), using
+	 * the rollout context tree Agent::m_rollout_ct in place of the agent's
+	 * model. The model and the rollout context tree are left unchanged.
+	 * \param horizon The number of complete action/percept steps to simulate.
+	 * \param last_percept Receives the last simulated percept (see
+	 *     Agent::perceptCode()), unless horizon is 0.
+	 * \return The total reward from the simulation. */
+	reward_t rolloutModelPlayout(int horizon, interaction_t &last_percept);
+
+	/** Estimate the reward of the cycle following a percept, for the cycles
+	 * beyond a truncated playout (playout-value option).
+	 * \param percept The percept (see Agent::perceptCode()).
+	 * \return The estimated reward. */
+	reward_t estimateReward(interaction_t percept) const;
+
+	/** Perform an action during a simulation of the search. Unless
+	 * Agent::m_revert_to_ancestor is set, this is the same as
+	 * Agent::modelUpdate(action_t). Otherwise the action is only recorded in
+	 * the simulation path and applied to the model once it is needed.
+	 * \param action The simulated action. */
+	void simulateAction(action_t action);
+
+	/** Generate a percept at a chance node during a simulation of the search.
+	 * Unless Agent::m_percept_cache is set, this is the same as
+	 * Agent::genPerceptAndUpdate(). Otherwise the percept is sampled from the
+	 * distribution stored at the chance node. If Agent::m_revert_to_ancestor
+	 * is set, the model is only brought up to date when that distribution is
+	 * incomplete.
+	 * \param cache The percept distribution stored at the chance node.
+	 * \param observation Receives the observation part of the generated
+	 *     percept.
+	 * \param reward Receives the reward part of the generated percept.
+	 * \return The index of the chance node's child corresponding to the
+	 *     percept (see Agent::perceptIndex()). */
+	interaction_t simulatePercept(PerceptCache &cache,
+	                              percept_t &observation, percept_t &reward);
+
+	/** Check whether progressive widening allows a chance node to have
+	 * another child, i.e. whether a new percept should be generated by
+	 * Agent::simulatePercept() rather than chosen among the node's children
+	 * (search-widening-k and search-widening-alpha options).
+	 * \param children The number of children of the chance node.
+	 * \param visits The number of visits to the chance node.
+	 * \return True if a new percept should be generated. */
+	bool admitPercept(size_t children, visits_t visits) const;
+
+	/** The number of actions a decision node considers under action
+	 * widening (search-action-widening-k and search-action-widening-alpha
+	 * options).
+	 * \param visits The number of visits to the decision node.
+	 * \return The number of actions, which may exceed the number of
+	 * actions available. */
+	int actionsConsidered(visits_t visits) const;
+
+	/** Receive a percept that was generated by Agent::simulatePercept() at a
+	 * previous visit to the same chance node.
+	 * \param cache The percept distribution stored at the chance node, which
+	 *     may hold a version of the model (see Agent::m_revert_to_snapshot).
+	 * \param code The percept (see Agent::perceptCode()).
+	 * \param observation Receives the observation part of the percept.
+	 * \param reward Receives the reward part of the percept. */
+	void simulateKnownPercept(PerceptCache &cache, interaction_t code,
+	                          percept_t &observation, percept_t &reward);
+
+	/** Estimate the future reward at a leaf of the search tree using
+	 * Agent::playout(), leaving the model in the state it was before.
+	 * \param horizon The number of complete action/percept steps to simulate.
+	 * \return The total reward from the playout. */
+	reward_t simulatePlayout(int horizon);
+
+	/** Check whether the search tree may grow by another node
+	 * (search-max-nodes option). */
+	bool canExpand(void) const;
+
+	/** Create a node of the search tree for the current state of the
+	 * simulation. If a transposition table is used, a node that was reached
+	 * in the same context during the current search is returned instead.
+	 * \param type The type of the node.
+	 * \param horizon How many cycles into the future the node will sample.
+	 * \return The node. */
+	SearchNode *newSearchNode(nodetype_t type, int horizon);
+
+	/** \return True if search nodes are shared through a transposition
+	 * table (search-transpositions option). */
+	bool sharesSearchNodes(void) const { return m_transpositions != NULL; }
+
+	/** Statistics describing the most recent call to Agent::search(). */
+	search_stats_t const& searchStats(void) const { return m_search_stats; }
+
+	/** Sets whether detailed metrics of each search are collected in
+	 * Agent::searchStats(), as for the metrics-log option. Off by
+	 * default. */
+	void collectMetrics(const bool collect);
+
 private:
 
+	/** Append an action or percept to the path of the current simulation. If
+	 * the model has already been updated with the same step (during a
+	 * previous simulation), the model need not be updated again.
+	 * \param step The action, or the percept encoded by Agent::perceptCode(). */
+	void pushSimulationStep(interaction_t step);
+
+	/** Bring the model up to date with the path of the current simulation.
+	 * Steps of the previous simulation that are not shared with the current
+	 * simulation are reverted, then the remaining steps of the current
+	 * simulation are applied. */
+	void syncModel(void);
+
+	/** Restore the model to the deepest chance node of the current
+	 * simulation at which a version of it is stored, for
+	 * Agent::syncModel(). */
+	void restoreSimulationVersion(void);
+
+	/** Restore a version of the model, and the history and attributes of the
+	 * agent at the time the version was retained.
+	 * \param version The version.
+	 * \param mu The state of the agent when the version was retained. */
+	void restoreModel(ct_version_t version, const ModelUndo &mu);
+
+	/** \return The model, which is a ::PersistentContextTree if
+	 * Agent::m_revert_to_snapshot is set. */
+	PersistentContextTree *persistentModel(void) const;
+
+	/** \return The model, which is a ::FactoredContextTree if
+	 * Agent::m_update_threads is greater than 1. */
+	FactoredContextTree *factoredModel(void) const;
+
+	/** The index of a percept among the children of a chance node (see
+	 * Agent::simulatePercept()). This is the observation, or the whole
+	 * percept (see Agent::perceptCode()) if Agent::m_percept_cache or
+	 * Agent::m_widening_k is set, or 0 if Agent::m_open_loop is set.
+	 * \param observation The observation part of the percept.
+	 * \param reward The reward part of the percept. */
+	interaction_t perceptIndex(percept_t observation, percept_t reward) const;
+
+	/** Replace the kept search tree Agent::m_search_tree by one of the
+	 * subtrees of its root, or by NULL if there is no such subtree.
+	 * \param index The index of the subtree. */
+	void advanceSearchTree(interaction_t index);
+
+	/** Search for the best action with several threads (search-threads
+	 * option), and check that the search is reproducible if
+	 * Agent::m_search_check is set.
+	 * \return The best action. */
+	action_t parallelSearch(void);
+
+	/** Search with each of the workers Agent::m_workers in its own thread,
+	 * and combine the statistics of the actions at the roots of their search
+	 * trees.
+	 * \param seed The seed of the workers' random number streams.
+	 * \param visits Receives the number of visits to each action.
+	 * \param means Receives the mean reward of each action. */
+	void runWorkers(unsigned int seed, std::vector<visits_t> &visits,
+	                std::vector<double> &means);
+
+	/** Make the agent's model (including the rollout model and the reward
+	 * estimates) the same as another agent's model. The context trees are
+	 * shared through instances of ::OverlayContextTree, so the other agent's
+	 * model must not change while this agent uses it. Frozen context trees
+	 * are copied once and then follow the other agent's history.
+	 * \param other The agent to copy. */
+	void copyModel(Agent const& other);
+
+	/** Replace the context trees by instances of ::FrozenContextTree
+	 * compiled from them once the agent stops learning. */
+	void freezeModel(void);
+
+	/** Sample from the kept search tree until Agent::m_ponder_stop is set.
+	 * Runs in Agent::m_ponder_thread.
+	 * \param seed The seed of the thread's stream of random numbers. */
+	void ponderLoop(unsigned int seed);
+
+	/** Compute the probability of every percept that begins with a given
+	 * prefix, according to the model. The model must be in the state of the
+	 * chance node at which the percept is generated.
+	 * \param prefix The first bits of the percepts.
+	 * \param probability The probability of the prefix.
+	 * \param percepts Receives the percepts (see Agent::perceptCode()).
+	 * \param probabilities Receives the probability of each percept. */
+	void enumeratePercepts(symbol_list_t &prefix, double probability,
+	                       std::vector<interaction_t> &percepts,
+	                       std::vector<double> &probabilities);
+
+	/** Encode a percept as a single integer, in the same bit order as
+	 * Agent::encodePercept(). */
+	interaction_t perceptCode(percept_t observation, percept_t reward) const;
+
+	/** Check whether the action chosen at the root of the search tree can
+	 * still change. This is the case unless either the best action cannot be
+	 * overtaken by another action within the remaining simulations, or the
+	 * Hoeffding confidence bound of the best action separates it from every
+	 * other action (search-stop-delta option).
+	 * \param remaining The number of simulations left in the search budget,
+	 * or a negative number if the budget is unknown.
+	 * \return True if the search can stop. */
+	bool searchConverged(int remaining) const;
+
+
 
 	/** Encode an action as a list of symbols.
 	 * \param symlist The symbol list to encode the action to.
@@ -205,15 +448,56 @@ private:
 	void decodePercept(const symbol_list_t &symlist, percept_t &observation, percept_t &reward);
 
 
+	/** A running average of rewards. */
+	struct reward_average_t {
+		reward_average_t(void) : mean(0.0), count(0) {}
+
+		/** Add a reward to the average. */
+		void add(reward_t reward);
+
+		reward_t mean;
+		age_t count;
+	};
+
 	/** Stores the configuration options. */
 	options_t &m_options;
 
 	/** A reference to the environment the agent interacts with. */
 	Environment const& m_env;
 
-	/** Context tree representing the agent's model of the environment. */
+	/** Context tree representing the agent's model of the environment. For
+	 * the workers of a parallel search, an ::OverlayContextTree over the
+	 * model of the agent they search for, or a copy of it once it is frozen.
+	 * Once the model is frozen, the same tree as Agent::m_frozen_ct. */
 	ContextTree *m_ct;
 
+	/** An optional shallower context tree which is trained on the same
+	 * interaction as Agent::m_ct and used in its place by Agent::playout(),
+	 * or NULL (rollout-ct-depth option). */
+	ContextTree *m_rollout_ct;
+
+	/** If true, the model is frozen once the learning period is over
+	 * (ct-freeze option). */
+	bool m_freeze_model;
+
+	/** The compiled model once it is frozen (owned as Agent::m_ct), or
+	 * NULL. */
+	FrozenContextTree *m_frozen_ct;
+
+	/** The compiled rollout model once it is frozen (owned as
+	 * Agent::m_rollout_ct), or NULL. */
+	FrozenContextTree *m_frozen_rollout_ct;
+
+	/** The number of threads which learn the bits of a percept in parallel,
+	 * if the model is a ::FactoredContextTree (ct-factored and
+	 * ct-update-threads options). */
+	int m_update_threads;
+
+	/** The model the agent learns, if it is shared with other agents
+	 * (shared-model-agents option), or NULL. The agent searches with
+	 * Agent::m_ct, an ::OverlayContextTree over it. */
+	SharedContextTree *m_shared_ct;
+
 	/** The number of interaction cycles the agent has been alive. */
 	age_t m_time_cycle;
 
@@ -230,9 +514,169 @@ private:
 	 * UCT algorithm. */
 	int m_mc_simulations;
 
-	/** The root node of the UCT search tree. */
+	/** The wall-clock time in milliseconds that may be spent choosing a new
+	 * action. If positive, it replaces Agent::m_mc_simulations as the search
+	 * budget (search-time-ms option). */
+	int m_search_time_ms;
+
+	/** The minimum number of simulations to conduct under a time budget, even
+	 * if the deadline has passed (search-min-simulations option). */
+	int m_search_min_simulations;
+
+	/** The maximum number of simulations to conduct under a time budget, or 0
+	 * for no limit (search-max-simulations option). */
+	int m_search_max_simulations;
+
+	/** The number of simulations between checks of whether the search has
+	 * converged, or 0 to never stop early (search-stop-interval option). */
+	int m_search_stop_interval;
+
+	/** The probability with which the confidence bound of the best action
+	 * may wrongly separate it from the other actions, or 0 to only stop
+	 * once the best action cannot be overtaken (search-stop-delta option). */
+	double m_search_stop_delta;
+
+	/** If true, the model is reverted after each simulation only as far as
+	 * the deepest node shared with the next simulation, rather than to the
+	 * root of the search tree (search-revert option). */
+	bool m_revert_to_ancestor;
+
+	/** If true, the model is a ::PersistentContextTree and versions of it are
+	 * stored at the chance nodes of the search tree (see PerceptCache), so
+	 * it is restored rather than reverted (search-revert option). Implies
+	 * Agent::m_revert_to_ancestor. */
+	bool m_revert_to_snapshot;
+
+	/** The version of the model at the root of the search tree, if
+	 * Agent::m_revert_to_snapshot is set. */
+	ct_version_t m_root_version;
+
+	/** How percept distributions are stored at chance nodes
+	 * (search-percept-cache option). Always set if
+	 * Agent::m_revert_to_ancestor is set. */
+	percept_cache_t m_percept_cache;
+
+	/** The maximum number of percept bits for which the whole percept
+	 * distribution is computed and stored in an alias table
+	 * (search-percept-enumerate-bits option). */
+	int m_percept_enumerate_bits;
+
+	/** The maximum number of nodes in the search tree, or 0 for no limit
+	 * (search-max-nodes option). */
+	int m_search_max_nodes;
+
+	/** The number of nodes in the current search tree. */
+	int m_search_nodes;
+
+	/** The maximum number of cycles simulated by Agent::playout(), or 0 for
+	 * no limit (playout-depth option). */
+	int m_playout_depth;
+
+	/** How the reward of the cycles beyond a truncated playout is estimated
+	 * (playout-value option). */
+	playout_value_t m_playout_value;
+
+	/** The average reward received in each cycle. */
+	reward_average_t m_reward_average;
+
+	/** The average reward received in the cycle following each percept (see
+	 * Agent::perceptCode()). */
+	std::map<interaction_t, reward_average_t> m_percept_value;
+
+	/** The last percept received from the environment, or -1 if there has
+	 * been none. */
+	interaction_t m_last_percept;
+
+	/** The table of search nodes shared between simulations which reach the
+	 * same context, or NULL if search nodes are not shared
+	 * (search-transpositions option). */
+	TranspositionTable *m_transpositions;
+
+	/** The coefficient k of progressive widening: a chance node visited n
+	 * times has at most k (n + 1)^alpha children, or any number if k is 0
+	 * (search-widening-k option). */
+	double m_widening_k;
+
+	/** The exponent alpha of progressive widening (search-widening-alpha
+	 * option). */
+	double m_widening_alpha;
+
+	/** If true, each chance node of the search tree has a single child
+	 * whatever the sampled percept, so that the nodes of the search tree
+	 * correspond to sequences of actions (search-loop option). */
+	bool m_open_loop;
+
+	/** The coefficient of action widening: a decision node visited n times
+	 * considers only the first k (n + 1)^alpha actions of a random order of
+	 * its actions, or all actions if k is 0 (search-action-widening-k
+	 * option). */
+	double m_action_widening_k;
+
+	/** The exponent alpha of action widening
+	 * (search-action-widening-alpha option). */
+	double m_action_widening_alpha;
+
+	/** The actions and percepts (see Agent::perceptCode()) of the current
+	 * simulation, starting at the root of the search tree. */
+	std::vector<interaction_t> m_simulation_path;
+
+	/** The actions and percepts that the model has been updated with since
+	 * the root of the search tree. */
+	std::vector<interaction_t> m_model_path;
+
+	/** The length of the common prefix of Agent::m_simulation_path and
+	 * Agent::m_model_path. */
+	size_t m_model_shared;
+
+	/** The percept distributions of the chance nodes of the current
+	 * simulation, which hold versions of the model if
+	 * Agent::m_revert_to_snapshot is set. */
+	std::vector<PerceptCache*> m_simulation_caches;
+
+	/** Statistics describing the most recent search. */
+	search_stats_t m_search_stats;
+
+	/** Whether detailed metrics of each search are collected (metrics-log
+	 * option). */
+	bool m_collect_metrics;
+
+	/** The statistics of the current search if metrics are being collected,
+	 * otherwise NULL. */
+	search_stats_t *m_metrics;
+
+	/** The number of actions taken within the search tree by the current
+	 * simulation. */
+	int m_simulation_depth;
+
+	/** The number of threads to search with (search-threads option). */
+	int m_search_threads;
+
+	/** If nonzero, every parallel search is repeated to check that it gives
+	 * the same result (search-check option). */
+	int m_search_check;
+
+	/** The configuration options of the workers. */
+	options_t m_worker_options;
+
+	/** The agents which search in parallel on behalf of this agent, if
+	 * Agent::m_search_threads is more than 1. */
+	std::vector<Agent*> m_workers;
+
+	/** The root node of the UCT search tree. Between searches, this is the
+	 * part of the previous search tree that follows the actual interaction,
+	 * or NULL if the search tree is not kept. */
 	SearchNode *m_search_tree;
 
+	/** Whether the search tree is kept between cycles and searched in the
+	 * background while waiting for the next percept (search-reuse option). */
+	search_reuse_t m_search_reuse;
+
+	/** The thread searching in the background, see Agent::ponder(). */
+	std::thread m_ponder_thread;
+
+	/** Set to stop the background search. */
+	std::atomic<bool> m_ponder_stop;
+
 	/** The number of cycles during which the agent learns. */
 	int m_learning_period;
 };
@@ -31,6 +31,9 @@ public:
 	// Constructor: set up the initial environment percept
 	// Implement in inherited class
 
+	/** Destroy the environment, which may be deleted through this class. */
+	virtual ~Environment(void) {}
+
 	virtual std::string print(void) const;
 
 	/** Receives the agent's action and calculates the new environment percept. */
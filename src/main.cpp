@@ -1,10 +1,12 @@
 #include <cassert>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
-#include <ctime>
+#include <functional>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include "agent.hpp"
 #include "environment.hpp"
@@ -25,6 +27,19 @@
 
 // Stream for logging
 std::ofstream logger; // A compact comma-separated value log
+std::ofstream metricsLogger; // Search metrics (metrics-log option)
+
+/** Run a step of the interaction cycle for each agent. With several agents,
+ * the steps run at the same time in the threads of a pool, one per agent.
+ * \param pool The pool, or NULL for a single agent.
+ * \param step The step, given the index of the agent. */
+void forEachAgent(WorkerPool *pool, std::function<void(size_t)> const& step) {
+	if (pool == NULL)
+		step(0);
+	else
+		pool->run(step);
+}
+
 
 /** The main agent/environment interaction loop. Each interaction cycle begins
  * with the agent receiving an observation and reward from the environment.
@@ -32,14 +47,27 @@ std::ofstream logger; // A compact comma-separated value log
  * interactions that took place are logged to the ::logger and ::compactLogger
  * streams. When the cycle equals a power of two, a summary of the interactions
  * is printed to the standard output.
- * \param ai The agent.
- * \param env The environment.
+ *
+ * Several agents, each with its own environment, may share a model
+ * (shared-model-agents option). They then all learn from their percepts at the
+ * same time, and then all search and act at the same time, so that no agent
+ * searches the model while another learns. Only the first agent is logged.
+ * \param agents The agents.
+ * \param envs The environment of each agent.
  * \param options The configuration options. */
-void mainLoop(Agent &ai, Environment &env, options_t &options) {
+void mainLoop(std::vector<Agent*> &agents, std::vector<Environment*> &envs,
+		options_t &options) {
+	const size_t n = agents.size();
+	Agent &ai = *agents[0];
+	Environment &env = *envs[0];
 
 	// Apply random seed (Defaut: 0)
 	srand(getOption<unsigned int>(options, "random-seed", 0));
 
+	// With several agents, each agent steps in its own thread, which draws
+	// random numbers from its own stream
+	WorkerPool *pool = n > 1 ? new WorkerPool(n, unsigned(rand())) : NULL;
+
 	// Verbose output (Default: false)
 	bool verbose = getOption<bool>(options, "verbose", false);
 
@@ -59,54 +87,104 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
 	int learning_period = getOption<int>(options, "learning-period", 0);
 	assert(0 <= learning_period);
 
+	// The interactions of each agent in the current cycle
+	std::vector<percept_t> observations(n), rewards(n);
+	std::vector<action_t> actions(n);
+	std::vector<char> explorations(n);
+
 	// Agent/environment interaction loop
-	for (int cycle = 1; !env.isFinished(); cycle++) {
+	for (int cycle = 1; ; cycle++) {
+
+		// Stop once any of the environments is finished
+		bool finished = false;
+		for (size_t i = 0; i < n; i++)
+			finished = finished || envs[i]->isFinished();
+		if (finished)
+			break;
 
 		// Check for agent termination
 		if (terminate_check && ai.age() > terminate_age) {
 			break;
 		}
 		
-		// Save the current clock cycle (to compute how long this cycle took)
-		clock_t cycle_start = clock();
-
-		// Get a percept from the environment
-		percept_t observation = env.getObservation();
-		percept_t reward = env.getReward();
-
+		// Save the current time (to compute how long this cycle took)
+		std::chrono::steady_clock::time_point cycle_start =
+			std::chrono::steady_clock::now();
 
 		if (learning_period > 0 && cycle > learning_period)
 			explore = false;
-		
-		// Update agent's environment model with the new percept
-		ai.modelUpdate(observation, reward);
 
-		// Determine best exploitive action, or explore
-		action_t action;
-		bool explored = false;
+		forEachAgent(pool, [&](size_t i) {
+			// Get a percept from the environment
+			observations[i] = envs[i]->getObservation();
+			rewards[i] = envs[i]->getReward();
 
-		if (explore && (rand01() < explore_rate)) { // Explore
-			explored = true;
-			action = ai.genRandomAction();
-		}
-		else { // Exploit
-			action = ai.search();
-		}
+			// Update agent's environment model with the new percept
+			agents[i]->modelUpdate(observations[i], rewards[i]);
+		});
 
-		// Send an action to the environment
-		env.performAction(action);
-		
-		// Update agent's environment model with the chosen action
-		ai.modelUpdate(action);
+		forEachAgent(pool, [&](size_t i) {
+			Agent &agent = *agents[i];
+
+			// Determine best exploitive action, or explore
+			action_t action;
+			bool explored = false;
+
+			if (explore && (rand01() < explore_rate)) { // Explore
+				explored = true;
+				action = agent.genRandomAction();
+			}
+			else { // Exploit
+				action = agent.search();
+			}
+
+			// Update agent's environment model with the chosen action
+			agent.modelUpdate(action);
+
+			// Send an action to the environment, letting the agent search in
+			// the meantime if pondering
+			agent.ponder(action);
+			envs[i]->performAction(action);
+			agent.stopPondering();
+
+			actions[i] = action;
+			explorations[i] = explored;
+		});
+
+		// Log the interactions of the first agent
+		percept_t observation = observations[0];
+		percept_t reward = rewards[0];
+		action_t action = actions[0];
+		bool explored = explorations[0] != 0;
 		
 		// Calculate how long this cycle took
-		double time = double(clock() - cycle_start) / double(CLOCKS_PER_SEC);
+		double time = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - cycle_start).count();
+
+		// Statistics of the search for this cycle's action (if any)
+		search_stats_t stats = explored ? search_stats_t() : ai.searchStats();
+		stats.simulations_pondered = ai.searchStats().simulations_pondered;
+		double hit_rate = stats.transposition_lookups == 0 ? 0.0
+			: double(stats.transposition_hits)
+			/ double(stats.transposition_lookups);
 
 		// Log this turn
 		logger << cycle << ", " << observation << ", " << reward << ", "
 			<< action << ", " << explored << ", " << explore_rate << ", "
 			<< ai.totalReward() << ", " << ai.averageReward() << ", "
-			<< time << ", " << ai.modelSize() << std::endl;
+			<< time << ", " << ai.modelSize() << ", " << stats.simulations
+			<< ", " << stats.simulations_saved << ", " << hit_rate << ", "
+			<< stats.nodes << ", " << stats.simulations_pondered << std::endl;
+
+		// Log the metrics of the search
+		if (metricsLogger.is_open()) {
+			metricsLogger << cycle << ", " << stats.simulations << ", "
+				<< stats.depth_mean << ", " << stats.depth_max << ", "
+				<< stats.nodes_created << ", " << stats.playout_steps << ", "
+				<< stats.ct_nodes_created << ", " << stats.ct_nodes_freed << ", "
+				<< stats.time_selection << ", " << stats.time_sampling << ", "
+				<< stats.time_playout << ", " << stats.time_revert << std::endl;
+		}
 
 		// Print to standard output when cycle == 2^n or on verbose option
 		if (verbose || (cycle & (cycle - 1)) == 0) {
@@ -127,10 +205,16 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
 
 	}
 
+	delete pool;
+
 	// Print summary to standard output
 	std::cout << std::endl << std::endl << "SUMMARY" << std::endl;
 	std::cout << "agent age: " << ai.age() << std::endl;
 	std::cout << "average reward: " << ai.averageReward() << std::endl;
+	for (size_t i = 1; i < n; i++) {
+		std::cout << "agent " << i << " average reward: "
+			<< agents[i]->averageReward() << std::endl;
+	}
 }
 
 
@@ -192,6 +276,31 @@ void processOptions(std::ifstream &in, options_t &options) {
 	}
 }
 
+/** Create an environment.
+ * \param name The name of the environment (environment option).
+ * \param options The configuration options.
+ * \return The environment, or NULL if the name is unknown. */
+Environment *newEnvironment(std::string const& name, options_t &options) {
+	if (name == "coin-flip") {
+		return new CoinFlip(options);
+	} else if (name == "extended-tiger") {
+		return new ExtendedTiger(options);
+	} else if (name == "kuhn-poker") {
+		return new KuhnPoker(options);
+	} else if (name == "maze") {
+		return new Maze(options);
+	} else if (name == "pacman") {
+		return new PacMan(options);
+	} else if (name == "rock-paper-scissors") {
+		return new RockPaperScissors(options);
+	} else if (name == "tictactoe") {
+		return new TicTacToe(options);
+	} else if (name == "tiger") {
+		return new Tiger(options);
+	}
+	return NULL;
+}
+
 /** Entry point of the program. Sets up logging, default configuration values,
  * environment and agent before starting the agent/environment interaction cycle
  * by calling mainLoop(). In the case of invalid command line arguments, it
@@ -210,8 +319,9 @@ int main(int argc, char *argv[]) {
 	// Set up logging, print header
 	logger.open(argv[2]);
 	logger << "cycle, observation, reward, action, explored, "
-	    << "explore_rate, total reward, average reward, time, model size"
-	    << std::endl;
+	    << "explore_rate, total reward, average reward, time, model size, "
+	    << "simulations, simulations saved, transposition hit rate, "
+	    << "search nodes, simulations pondered" << std::endl;
 
 
 	// Stores configuration options
@@ -234,27 +344,22 @@ int main(int argc, char *argv[]) {
 	processOptions(conf, options);
 	conf.close();
 
+	// Set up the optional metrics log, print header
+	std::string metrics_log;
+	getOption(options, "metrics-log", std::string(""), metrics_log);
+	if (!metrics_log.empty()) {
+		metricsLogger.open(metrics_log.c_str());
+		metricsLogger << "cycle, simulations, mean depth, max depth, "
+			<< "search nodes created, playout steps, ct nodes created, "
+			<< "ct nodes freed, selection time, sampling time, playout time, "
+			<< "revert time" << std::endl;
+	}
+
 	// Set up the environment.
-	Environment *env;
 	std::string environment_name;
 	getRequiredOption(options, "environment", environment_name);
-	if (environment_name == "coin-flip") {
-		env = new CoinFlip(options);
-	} else if (environment_name == "extended-tiger") {
-		env = new ExtendedTiger(options);
-	} else if (environment_name == "kuhn-poker") {
-		env = new KuhnPoker(options);
-	} else if (environment_name == "maze") {
-		env = new Maze(options);
-	} else if (environment_name == "pacman") {
-		env = new PacMan(options);
-	} else if (environment_name == "rock-paper-scissors") {
-		env = new RockPaperScissors(options);
-	} else if (environment_name == "tictactoe") {
-		env = new TicTacToe(options);
-	} else if (environment_name == "tiger") {
- 		env = new Tiger(options);
- 	} else {
+	Environment *env = newEnvironment(environment_name, options);
+	if (env == NULL) {
 		std::cerr << "ERROR: unknown environment '" << environment_name << "'"
 		    << std::endl;
 		return EXIT_FAILURE;
@@ -276,13 +381,33 @@ int main(int argc, char *argv[]) {
 		          << "'" << std::endl;
 	}
 
-	// Set up the agent
+	// Set up the agent, and optionally more agents sharing its model, each
+	// with its own environment (Default: one agent)
+	int shared_model_agents;
+	getOption(options, "shared-model-agents", 1, shared_model_agents);
+	assert(1 <= shared_model_agents);
+	std::vector<Environment*> envs(1, env);
+	for (int i = 1; i < shared_model_agents; i++)
+		envs.push_back(newEnvironment(environment_name, options));
 	Agent ai(options, *env);
+	ai.collectMetrics(metricsLogger.is_open());
+	std::vector<Agent*> agents(1, &ai);
+	for (int i = 1; i < shared_model_agents; i++) {
+		agents.push_back(new Agent(options, *envs[i]));
+		agents[i]->shareModel(ai);
+	}
 
 	// Run the main agent/environment interaction loop
-	mainLoop(ai, *env, options);
+	mainLoop(agents, envs, options);
+
+	for (int i = 1; i < shared_model_agents; i++) {
+		delete agents[i];
+		delete envs[i];
+	}
 
 	logger.close();
+	if (metricsLogger.is_open())
+		metricsLogger.close();
 
 	return EXIT_SUCCESS;
 }
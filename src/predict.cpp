@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <thread>
 #include "predict.hpp"
 #include "util.hpp"
 
@@ -8,6 +10,16 @@
  * is made a constant for efficiency reasons. */
 static const double log_half = std::log(0.5);
 
+/** The bound on the ratios \f$ \beta \f$ and \f$ 1 / \beta \f$ stored by a
+ * ::RatioContextTree. */
+static const double beta_limit = 1e100;
+
+/** Limit a ratio stored by a ::RatioContextTree to the range
+ * \f$ [1 / \beta_{limit}, \beta_{limit}] \f$. */
+static inline double limitBeta(const double beta) {
+	return std::min(std::max(beta, 1.0 / beta_limit), beta_limit);
+}
+
 CTNode::CTNode(void) :
 	m_log_kt(0.0), m_log_probability(0.0)
 {
@@ -36,9 +48,15 @@ int CTNode::size(void) const {
 
 // Added to the previous logKT estimate upon observing a new symbol.
 weight_t CTNode::logKTMultiplier(const symbol_t symbol) const {
+	return std::log(ktMultiplier(symbol));
+}
+
+
+// The KT estimate of the probability of the next symbol.
+weight_t CTNode::ktMultiplier(const symbol_t symbol) const {
 	double numerator = double(m_count[symbol]) + 0.5;
 	double denominator = double(visits() + 1);
-	return std::log(numerator / denominator);
+	return numerator / denominator;
 }
 
 
@@ -59,15 +77,21 @@ void CTNode::updateLogProbability(void) {
 		log_child_prob += child(false) ? child(false)->logProbability() : 0.0;
 		log_child_prob += child(true) ? child(true)->logProbability() : 0.0;
 
-		// Calculate the log weighted probability. Use the formulation which
-		// has the least chance of overflow (see function doc for details).
-		double a = std::max(m_log_kt, log_child_prob);
-		double b = std::min(m_log_kt, log_child_prob);
-		m_log_probability = log_half + a + std::log(1.0 + std::exp(b - a));
+		m_log_probability = logWeightedProbability(m_log_kt, log_child_prob);
 	}
 }
 
 
+// The log weighted probability of a node with children. Use the formulation
+// which has the least chance of overflow (see CTNode::updateLogProbability()).
+weight_t CTNode::logWeightedProbability(weight_t log_kt,
+		weight_t log_child_prob) {
+	double a = std::max(log_kt, log_child_prob);
+	double b = std::min(log_kt, log_child_prob);
+	return log_half + a + std::log(1.0 + std::exp(b - a));
+}
+
+
 // Update probability estimates upon observing a new symbol.
 void CTNode::update(const symbol_t symbol) {
 	m_log_kt += logKTMultiplier(symbol);       // Update KT estimate
@@ -92,7 +116,7 @@ void CTNode::revert(const symbol_t symbol) {
 
 
 ContextTree::ContextTree(const int depth) :
-	m_root(new CTNode()), m_depth(depth)
+	m_root(new CTNode()), m_depth(depth), m_nodes_created(0)
 {
 	assert(depth > 0);
 	m_context = new CTNode*[m_depth + 1];
@@ -100,6 +124,15 @@ ContextTree::ContextTree(const int depth) :
 }
 
 
+// Tree without nodes.
+ContextTree::ContextTree(const int depth, symbol_list_t const& history) :
+	m_history(history), m_root(NULL), m_depth(depth), m_nodes_created(0)
+{
+	assert(depth > 0);
+	m_context = new CTNode*[m_depth + 1];
+}
+
+
 // Delete tree and history.
 ContextTree::~ContextTree(void) {
 	m_history.clear();
@@ -154,11 +187,109 @@ void ContextTree::updateHistory(const symbol_t symbol) {
 void ContextTree::updateHistory(symbol_list_t const& symbols) {
 	symbol_list_t::const_iterator iter;
 	for (iter = symbols.begin(); iter != symbols.end(); iter++) {
-		m_history.push_back(*iter);
+		updateHistory(*iter);
 	}
 }
 
 
+// Learn a list of symbols, splitting the nodes below the top levels between
+// threads
+void ContextTree::updateInBulk(symbol_list_t const& symbols,
+		symbol_list_t const& learn, const int threads) {
+	assert(symbols.size() == learn.size());
+	if (threads <= 1) {
+		for (size_t i = 0; i < symbols.size(); i++) {
+			if (learn[i])
+				update(symbols[i]);
+			else
+				updateHistory(symbols[i]);
+		}
+		return;
+	}
+
+	const size_t first = m_history.size();
+	m_history.insert(m_history.end(), symbols.begin(), symbols.end());
+
+	// Split the tree at a level with a few subtrees for each thread
+	int split = 0;
+	while (split < m_depth && (1 << split) < 4 * threads)
+		split++;
+
+	// Learn the symbols in the levels above the split, except for the
+	// weighted probabilities, and list the symbols of each subtree
+	std::vector<CTNode*> subtrees(size_t(1) << split, NULL);
+	std::vector<std::vector<size_t> > indices(subtrees.size());
+	for (size_t index = std::max(first, size_t(m_depth));
+			index < m_history.size(); index++) {
+		if (!learn[index - first])
+			continue;
+		const symbol_t symbol = m_history[index];
+		CTNode *node = m_root;
+		size_t subtree = 0;
+		for (int i = 1; i <= split; i++) {
+			node->m_log_kt += node->logKTMultiplier(symbol);
+			node->m_count[symbol]++;
+			CTNode *&child = node->m_child[m_history[index - i]];
+			if (child == NULL) {
+				child = new CTNode();
+				m_nodes_created++;
+			}
+			node = child;
+			subtree = 2 * subtree + m_history[index - i];
+		}
+		subtrees[subtree] = node;
+		indices[subtree].push_back(index);
+	}
+
+	// Learn the symbols of each subtree in order, as ContextTree::update()
+	// does from the split downwards
+	std::vector<size_t> created(threads, 0);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.push_back(std::thread([this, &subtrees, &indices, &created,
+				split, threads, t]() {
+			std::vector<CTNode*> context(m_depth + 1);
+			for (size_t s = t; s < subtrees.size(); s += threads) {
+				for (size_t j = 0; j < indices[s].size(); j++) {
+					const size_t index = indices[s][j];
+					CTNode *node = subtrees[s];
+					context[split] = node;
+					for (int i = split + 1; i <= m_depth; i++) {
+						CTNode *&child = node->m_child[m_history[index - i]];
+						if (child == NULL) {
+							child = new CTNode();
+							created[t]++;
+						}
+						node = child;
+						context[i] = node;
+					}
+					const symbol_t symbol = m_history[index];
+					for (int i = m_depth; i >= split; i--)
+						context[i]->update(symbol);
+				}
+			}
+		}));
+	}
+	for (int t = 0; t < threads; t++) {
+		workers[t].join();
+		m_nodes_created += created[t];
+	}
+
+	updateTopLevels(m_root, 0, split);
+}
+
+
+// Recompute the weighted probabilities above the split, children first
+void ContextTree::updateTopLevels(CTNode *node, const int level,
+		const int split) {
+	if (node == NULL || level >= split)
+		return;
+	updateTopLevels(node->m_child[false], level + 1, split);
+	updateTopLevels(node->m_child[true], level + 1, split);
+	node->updateLogProbability();
+}
+
+
 // Revert the most recent update.
 void ContextTree::revert(void) {
 
@@ -205,12 +336,10 @@ weight_t ContextTree::predict(const symbol_t symbol) {
 	}
 
 	// Calculate the probability of the symbol s given the history h using
-	// p(s | h) = p(hs) / p(h) = exp(ln p(hs) - ln p(h)).
-	weight_t prob_history = logBlockProbability();
-	update(symbol);
-	weight_t prob_sequence = logBlockProbability();
-	revert();
-	return std::exp(prob_sequence - prob_history);
+	// p(s | h) = p(hs) / p(h) = exp(ln p(hs) - ln p(h)), where ln p(hs) is
+	// computed along the current context without changing the tree.
+	findContext();
+	return predictContext(symbol);
 }
 
 
@@ -246,8 +375,21 @@ void ContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols, const int bi
 
 	symbols.resize(bits);
 	for (int i = 0; i < bits; i++) {
-		symbols[i] = rand01() < predict(true);
-		update(symbols[i]);
+		if (m_history.size() < size_t(m_depth)) {
+			symbols[i] = rand01() < 0.5;
+			updateHistory(symbols[i]);
+			continue;
+		}
+
+		// Predict and update along the same context, rather than traversing
+		// the tree once for the prediction and again for the update
+		updateContext();
+		const symbol_t symbol = rand01() < predictContext(true);
+		for (int j = m_depth; j >= 0; j--) {
+			m_context[j]->update(symbol);
+		}
+		updateHistory(symbol);
+		symbols[i] = symbol;
 	}
 }
 
@@ -258,6 +400,66 @@ double ContextTree::logBlockProbability(void) const {
 }
 
 
+// FNV-1a hash of the most recent symbols of the history and their number
+context_hash_t ContextTree::contextHash(void) const {
+	const context_hash_t prime = 1099511628211ULL;
+	context_hash_t hash = 14695981039346656037ULL;
+
+	const size_t length = std::min(m_history.size(), size_t(m_depth));
+	symbol_list_t::const_reverse_iterator it = m_history.rbegin();
+	for (size_t i = 0; i < length; i++, it++) {
+		hash = (hash ^ (*it ? 1 : 0)) * prime;
+	}
+	return (hash ^ context_hash_t(length)) * prime;
+}
+
+
+// The conditional probability of a symbol given the current context, as
+// found by ContextTree::updateContext() or ContextTree::findContext(). This
+// repeats the computations of CTNode::update() along the context without
+// changing any node. Missing nodes are treated as new (empty) nodes.
+weight_t ContextTree::predictContext(const symbol_t symbol) const {
+	static const CTNode empty;
+
+	weight_t log_probability = 0.0; // ln P_w of the updated child on the path
+	for (int i = m_depth; i >= 0; i--) {
+		const CTNode *node = m_context[i] ? m_context[i] : &empty;
+		const weight_t log_kt = node->m_log_kt + node->logKTMultiplier(symbol);
+
+		// Nodes above the deepest level have a child on the path (which
+		// CTNode::update() would have created), so are never leaf nodes
+		if (i == m_depth) {
+			log_probability = log_kt;
+		} else {
+			const symbol_t path = m_history[m_history.size() - i - 1];
+			double log_child_prob = 0.0;
+			log_child_prob += !path ? log_probability
+				: (node->child(false) ? node->child(false)->logProbability() : 0.0);
+			log_child_prob += path ? log_probability
+				: (node->child(true) ? node->child(true)->logProbability() : 0.0);
+
+			log_probability = CTNode::logWeightedProbability(log_kt,
+			                                                 log_child_prob);
+		}
+	}
+
+	return std::exp(log_probability - m_root->logProbability());
+}
+
+
+// Find the nodes in the current context without creating missing nodes
+void ContextTree::findContext(void) {
+	assert(m_history.size() >= size_t(m_depth));
+
+	m_context[0] = m_root;
+	symbol_list_t::reverse_iterator symbol_iter = m_history.rbegin();
+	for (int i = 1; i <= m_depth; symbol_iter++, i++) {
+		m_context[i] = m_context[i - 1]
+			? m_context[i - 1]->m_child[*symbol_iter] : NULL;
+	}
+}
+
+
 // Get the nodes in the current context
 void ContextTree::updateContext(void) {
 	assert(m_history.size() >= m_depth);
@@ -272,8 +474,1640 @@ void ContextTree::updateContext(void) {
 		node = &((*node)->m_child[*symbol_iter]);
 
 		// Add node to the path (creating it if it does not exist)
-		if (*node == NULL)
+		if (*node == NULL) {
 			*node = new CTNode();
+			m_nodes_created++;
+		}
 		m_context[i] = *node;
 	}
 }
+
+
+
+
+OverlayContextTree::OverlayContextTree(ContextTree const& base) :
+	ContextTree(int(base.depth()), base.history()), m_base(base), m_created(0),
+	m_clean_size(base.historySize())
+{
+	assert(base.root() != NULL);
+	m_base_context = new const CTNode*[m_depth + 1];
+	m_nodes_created = base.nodesCreated();
+}
+
+
+// Delete the copies and created nodes, leaving the base alone.
+OverlayContextTree::~OverlayContextTree(void) {
+	discard();
+	delete[] m_base_context;
+}
+
+
+// Return to the current state of the base.
+void OverlayContextTree::clear(void) {
+	m_history = m_base.history();
+	m_clean_size = m_history.size();
+	discard();
+	m_nodes_created = m_base.nodesCreated();
+}
+
+
+// Discard all updates. Deleting a copy also deletes the created nodes below it.
+void OverlayContextTree::discard(void) {
+	std::unordered_map<const CTNode*, CTNode*>::iterator it;
+	for (it = m_copies.begin(); it != m_copies.end(); it++)
+		delete it->second;
+	m_copies.clear();
+	m_created = 0;
+	m_pending.clear();
+	m_pending_update.clear();
+}
+
+
+// Apply the pending reverts, from the most recent one. The removed symbols are
+// put back into the history to provide their contexts.
+void OverlayContextTree::sync(void) {
+	for (size_t i = m_pending.size(); i > 0; i--)
+		m_history.push_back(m_pending[i - 1]);
+
+	for (size_t i = 0; i < m_pending.size(); i++) {
+		const symbol_t symbol = m_history.back();
+		m_history.pop_back();
+		if (!m_pending_update[i] || m_history.size() < size_t(m_depth))
+			continue;
+
+		overlayContext(false);
+		for (int j = m_depth; j >= 0; j--) {
+			CTNode *node = m_context[j];
+			node->m_count[symbol]--;
+
+			// Delete an unnecessary created child node, as CTNode::revert() does
+			const CTNode *base = m_base_context[j];
+			CTNode *&created = node->m_child[symbol];
+			if ((base == NULL || base->m_child[symbol] == NULL)
+					&& created != NULL && created->visits() == 0) {
+				m_created -= created->size();
+				delete created;
+				created = NULL;
+			}
+
+			node->m_log_kt -= node->logKTMultiplier(symbol);
+			updateLogProbability(j);
+		}
+	}
+
+	m_pending.clear();
+	m_pending_update.clear();
+}
+
+
+// The copy of a node of the base
+CTNode *OverlayContextTree::copy(const CTNode *base) const {
+	std::unordered_map<const CTNode*, CTNode*>::const_iterator it =
+		m_copies.find(base);
+	return it == m_copies.end() ? NULL : it->second;
+}
+
+
+// Copy a node of the base, without its children
+CTNode *OverlayContextTree::makeCopy(const CTNode *base) {
+	CTNode *node = new CTNode(*base);
+	node->m_child[0] = NULL;
+	node->m_child[1] = NULL;
+	m_copies[base] = node;
+	return node;
+}
+
+
+// Get the nodes of the base and of the overlay in the current context
+void OverlayContextTree::overlayContext(const bool create) {
+	assert(m_history.size() >= size_t(m_depth));
+
+	const CTNode *base = m_base.root();
+	CTNode *node = copy(base);
+	if (create && node == NULL)
+		node = makeCopy(base);
+	m_base_context[0] = base;
+	m_context[0] = node;
+
+	// Traverse the base and the overlay from root to leaf according to the
+	// context
+	symbol_list_t::reverse_iterator symbol_iter = m_history.rbegin();
+	for (int i = 1; i <= m_depth; symbol_iter++, i++) {
+		const symbol_t symbol = *symbol_iter;
+		CTNode *parent = m_context[i - 1];
+		if (base != NULL && base->m_child[symbol] != NULL) {
+			// The base has the child, which may have been copied
+			base = base->m_child[symbol];
+			node = copy(base);
+			if (create && node == NULL)
+				node = makeCopy(base);
+		} else {
+			// Otherwise the child may have been created below the parent
+			base = NULL;
+			node = parent ? parent->m_child[symbol] : NULL;
+			if (create && node == NULL) {
+				node = new CTNode();
+				parent->m_child[symbol] = node;
+				m_created++;
+				m_nodes_created++;
+			}
+		}
+		m_base_context[i] = base;
+		m_context[i] = node;
+	}
+}
+
+
+// The current state of a child of a node in the current context
+const CTNode *OverlayContextTree::child(const int level,
+		const symbol_t symbol) const {
+	const CTNode *base = m_base_context[level];
+	if (base != NULL && base->m_child[symbol] != NULL) {
+		const CTNode *node = copy(base->m_child[symbol]);
+		return node ? node : base->m_child[symbol];
+	}
+	return m_context[level] ? m_context[level]->m_child[symbol] : NULL;
+}
+
+
+// Recalculate the log weighted probability of a node in the current context
+// from its KT estimate and its children
+void OverlayContextTree::updateLogProbability(const int level) {
+	CTNode *node = m_context[level];
+	const CTNode *child0 = child(level, false);
+	const CTNode *child1 = child(level, true);
+	if (child0 == NULL && child1 == NULL) {
+		node->m_log_probability = node->m_log_kt;
+	} else {
+		double log_child_prob = 0.0;
+		log_child_prob += child0 ? child0->logProbability() : 0.0;
+		log_child_prob += child1 ? child1->logProbability() : 0.0;
+		node->m_log_probability =
+			CTNode::logWeightedProbability(node->m_log_kt, log_child_prob);
+	}
+}
+
+
+// Update the copies of the nodes in the current context
+void OverlayContextTree::update(const symbol_t symbol) {
+	sync();
+	if (m_history.size() >= size_t(m_depth)) {
+		overlayContext(true);
+		for (int i = m_depth; i >= 0; i--) {
+			CTNode *node = m_context[i];
+			node->m_log_kt += node->logKTMultiplier(symbol);
+			updateLogProbability(i);
+			node->m_count[symbol]++;
+		}
+	}
+	m_history.push_back(symbol);
+	if (m_copies.empty())
+		m_clean_size = m_history.size();
+}
+
+
+// Append a symbol to the history, after applying the pending reverts (whose
+// contexts would otherwise be lost)
+void OverlayContextTree::updateHistory(const symbol_t symbol) {
+	sync();
+	m_history.push_back(symbol);
+	if (m_copies.empty())
+		m_clean_size = m_history.size();
+}
+
+
+// Defer the revert of the most recent update. An update below
+// OverlayContextTree::m_clean_size did not change any node (it was made with a
+// history shorter than the depth), so only its symbol is removed.
+void OverlayContextTree::revert(void) {
+	if (m_history.size() <= m_clean_size) {
+		revertHistory(1);
+		return;
+	}
+	m_pending.push_back(m_history.back());
+	m_pending_update.push_back(true);
+	m_history.pop_back();
+	if (m_history.size() == m_clean_size)
+		discard();
+}
+
+
+// Shrink the history, which may have to provide the contexts of pending
+// reverts. Below OverlayContextTree::m_clean_size there is nothing to revert.
+void OverlayContextTree::revertHistory(const int num_symbols) {
+	assert(0 <= num_symbols && size_t(num_symbols) <= m_history.size());
+	for (int i = 0; i < num_symbols; i++) {
+		if (m_history.size() > m_clean_size) {
+			m_pending.push_back(m_history.back());
+			m_pending_update.push_back(false);
+		}
+		m_history.pop_back();
+		if (m_history.size() <= m_clean_size) {
+			discard();
+			m_clean_size = m_history.size();
+		}
+	}
+}
+
+
+// The conditional probability of symbol given the history
+weight_t OverlayContextTree::predict(const symbol_t symbol) {
+	sync();
+	if (m_history.size() < size_t(m_depth)) {
+		return 0.5;
+	}
+	overlayContext(false);
+	return predictContext(symbol);
+}
+
+
+// Sample and update along the same context, as ContextTree does
+void OverlayContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols,
+		const int bits) {
+	sync();
+	symbols.resize(bits);
+	for (int i = 0; i < bits; i++) {
+		if (m_history.size() < size_t(m_depth)) {
+			symbols[i] = rand01() < 0.5;
+			m_history.push_back(symbols[i]);
+			if (m_copies.empty())
+				m_clean_size = m_history.size();
+			continue;
+		}
+
+		overlayContext(true);
+		const symbol_t symbol = rand01() < predictContext(true);
+		for (int j = m_depth; j >= 0; j--) {
+			CTNode *node = m_context[j];
+			node->m_log_kt += node->logKTMultiplier(symbol);
+			updateLogProbability(j);
+			node->m_count[symbol]++;
+		}
+		m_history.push_back(symbol);
+		symbols[i] = symbol;
+	}
+}
+
+
+// The log block probability at the (copy of the) root. Applying the pending
+// reverts does not change the observable state of the overlay.
+double OverlayContextTree::logBlockProbability(void) const {
+	const_cast<OverlayContextTree*>(this)->sync();
+	const CTNode *root = copy(m_base.root());
+	return root ? root->logProbability() : m_base.logBlockProbability();
+}
+
+
+// The nodes of the base plus the nodes created in the overlay
+size_t OverlayContextTree::size(void) const {
+	const_cast<OverlayContextTree*>(this)->sync();
+	return m_base.size() + m_created;
+}
+
+
+// The conditional probability of a symbol given the current context, as in
+// ContextTree::predictContext()
+weight_t OverlayContextTree::predictContext(const symbol_t symbol) const {
+	static const CTNode empty;
+
+	weight_t log_probability = 0.0;
+	for (int i = m_depth; i >= 0; i--) {
+		const CTNode *node = m_context[i] ? m_context[i]
+			: (m_base_context[i] ? m_base_context[i] : &empty);
+		const weight_t log_kt = node->m_log_kt + node->logKTMultiplier(symbol);
+
+		if (i == m_depth) {
+			log_probability = log_kt;
+		} else {
+			const symbol_t path = m_history[m_history.size() - i - 1];
+			const CTNode *other = child(i, !path);
+			double log_child_prob = 0.0;
+			log_child_prob += !path ? log_probability
+				: (other ? other->logProbability() : 0.0);
+			log_child_prob += path ? log_probability
+				: (other ? other->logProbability() : 0.0);
+			log_probability = CTNode::logWeightedProbability(log_kt,
+			                                                 log_child_prob);
+		}
+	}
+
+	return std::exp(log_probability - logBlockProbability());
+}
+
+
+
+
+PersistentContextTree::PersistentContextTree(const int depth) :
+	ContextTree(depth, symbol_list_t())
+{
+	m_root = new PersistentCTNode();
+}
+
+
+// Release the current version. The base class then has no nodes to delete.
+PersistentContextTree::~PersistentContextTree(void) {
+	release(m_root);
+	m_root = NULL;
+}
+
+
+// Clear the history and start a new version without nodes.
+void PersistentContextTree::clear(void) {
+	m_history.clear();
+	release(m_root);
+	m_root = new PersistentCTNode();
+}
+
+
+// Revert the most recent update, releasing unnecessary child nodes.
+void PersistentContextTree::revert(void) {
+	if (m_history.size() == 0)
+		return;
+
+	const symbol_t symbol = m_history.back();
+	m_history.pop_back();
+
+	// As CTNode::revert() for each node in the context, on nodes which are
+	// not shared with another version
+	if (m_history.size() >= size_t(m_depth)) {
+		updateContext();
+		for (int i = m_depth; i >= 0; i--) {
+			CTNode *node = m_context[i];
+			node->m_count[symbol]--;
+			if (node->m_child[symbol] && node->m_child[symbol]->visits() == 0) {
+				release(node->m_child[symbol]);
+				node->m_child[symbol] = NULL;
+			}
+			node->m_log_kt -= node->logKTMultiplier(symbol);
+			node->updateLogProbability();
+		}
+	}
+}
+
+
+// The current version gains a reference
+ct_version_t PersistentContextTree::retainVersion(void) {
+	static_cast<PersistentCTNode*>(m_root)->m_refs++;
+	return static_cast<PersistentCTNode*>(m_root);
+}
+
+
+// Swap the current version for another
+void PersistentContextTree::restoreVersion(ct_version_t version) {
+	PersistentCTNode *root = const_cast<PersistentCTNode*>(version);
+	root->m_refs++;
+	release(m_root);
+	m_root = root;
+}
+
+
+void PersistentContextTree::releaseVersion(ct_version_t version) {
+	release(const_cast<PersistentCTNode*>(version));
+}
+
+
+// Get the nodes in the current context, creating missing nodes and copying
+// shared ones. A copy shares the children of the original.
+void PersistentContextTree::updateContext(void) {
+	assert(m_history.size() >= size_t(m_depth));
+
+	CTNode **link = &m_root;
+	symbol_list_t::reverse_iterator symbol_iter = m_history.rbegin();
+	for (int i = 0; ; symbol_iter++, i++) {
+		PersistentCTNode *node = static_cast<PersistentCTNode*>(*link);
+		if (node == NULL) {
+			node = new PersistentCTNode();
+			m_nodes_created++;
+		} else if (node->m_refs > 1) {
+			node->m_refs--;
+			node = new PersistentCTNode(*node);
+			node->m_refs = 1;
+			for (int s = 0; s < 2; s++) {
+				if (node->m_child[s])
+					static_cast<PersistentCTNode*>(node->m_child[s])->m_refs++;
+			}
+			m_nodes_created++;
+		}
+		*link = node;
+		m_context[i] = node;
+
+		if (i == m_depth)
+			break;
+		link = &node->m_child[*symbol_iter];
+	}
+}
+
+
+// Delete the node once unreferenced. Its children are released first, so
+// the destructor of CTNode finds none to delete.
+void PersistentContextTree::release(CTNode *node) {
+	PersistentCTNode *p = static_cast<PersistentCTNode*>(node);
+	if (--p->m_refs > 0)
+		return;
+
+	for (int s = 0; s < 2; s++) {
+		if (p->m_child[s]) {
+			release(p->m_child[s]);
+			p->m_child[s] = NULL;
+		}
+	}
+	delete p;
+}
+
+
+// Compile the nodes of the tree in breadth-first order. The children of each
+// node follow those of the nodes before it, so they are numbered as they are
+// found.
+FrozenContextTree::FrozenContextTree(ContextTree const& tree) :
+	ContextTree(int(tree.depth()), tree.history()),
+	m_path(size_t(tree.depth()) + 1)
+{
+	assert(tree.root() != NULL);
+	std::vector<const CTNode*> order(1, tree.root());
+	for (size_t i = 0; i < order.size(); i++) {
+		for (int s = 0; s < 2; s++) {
+			if (order[i]->m_child[s])
+				order.push_back(order[i]->m_child[s]);
+		}
+	}
+	assert(order.size() <= size_t(UINT32_MAX));
+
+	m_nodes.resize(order.size());
+	uint32_t next = 1;
+	for (size_t i = 0; i < order.size(); i++) {
+		frozen_node_t &node = m_nodes[i];
+		node.log_kt = order[i]->m_log_kt;
+		node.log_probability = order[i]->m_log_probability;
+		for (int s = 0; s < 2; s++) {
+			node.count[s] = uint32_t(order[i]->m_count[s]);
+			node.child[s] = order[i]->m_child[s] ? next++ : 0;
+		}
+	}
+	m_nodes_created = tree.nodesCreated();
+}
+
+
+// Copy the nodes and the history.
+FrozenContextTree::FrozenContextTree(FrozenContextTree const& tree) :
+	ContextTree(int(tree.depth()), tree.history()), m_nodes(tree.m_nodes),
+	m_path(tree.m_path.size())
+{
+	assert(tree.m_undo_size.empty());
+	m_nodes_created = tree.nodesCreated();
+}
+
+
+// Clear history and nodes.
+void FrozenContextTree::clear(void) {
+	m_history.clear();
+	m_nodes.assign(1, frozen_node_t());
+	m_undo.clear();
+	m_undo_size.clear();
+}
+
+
+// Update the tree with a single new symbol.
+void FrozenContextTree::update(const symbol_t symbol) {
+	if (m_history.size() >= size_t(m_depth)) {
+		const size_t size = m_nodes.size();
+		findPath(true);
+		learnPath(symbol, size);
+	}
+	updateHistory(symbol);
+}
+
+
+// Restore the nodes of the context of the most recent update, and remove the
+// nodes it created. These were appended to the array, and each is linked
+// from the node before it on the path.
+void FrozenContextTree::revert(void) {
+	if (m_history.size() == 0)
+		return;
+
+	const symbol_t symbol = m_history.back();
+	m_history.pop_back();
+	if (m_history.size() < size_t(m_depth))
+		return;
+
+	const size_t size = m_undo_size.back();
+	m_undo_size.pop_back();
+	const size_t first = m_undo.size() - (m_depth + 1);
+	for (int i = 0; i <= m_depth; i++) {
+		frozen_undo_t const& undo = m_undo[first + i];
+		frozen_node_t &node = m_nodes[undo.node];
+		node.log_kt = undo.log_kt;
+		node.log_probability = undo.log_probability;
+		node.count[symbol]--;
+		if (undo.node >= size) {
+			frozen_node_t &parent = m_nodes[m_undo[first + i - 1].node];
+			parent.child[m_history[m_history.size() - i]] = 0;
+		}
+	}
+	m_undo.resize(first);
+	m_nodes.resize(size);
+}
+
+
+// The conditional probability of symbol given the history
+weight_t FrozenContextTree::predict(const symbol_t symbol) {
+	if (m_history.size() < size_t(m_depth))
+		return 0.5;
+
+	return predictPath(symbol, findPath(false));
+}
+
+
+// Predict, update and save each symbol along the same path
+void FrozenContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols,
+		const int bits) {
+	symbols.resize(bits);
+	for (int i = 0; i < bits; i++) {
+		if (m_history.size() < size_t(m_depth)) {
+			symbols[i] = rand01() < 0.5;
+			updateHistory(symbols[i]);
+			continue;
+		}
+
+		const size_t size = m_nodes.size();
+		findPath(true);
+		const symbol_t symbol = rand01() < predictPath(true, m_depth);
+		learnPath(symbol, size);
+		updateHistory(symbol);
+		symbols[i] = symbol;
+	}
+}
+
+
+// the logarithm of the block probability of the whole sequence
+double FrozenContextTree::logBlockProbability(void) const {
+	return m_nodes[0].log_probability;
+}
+
+
+// Walk down from the root according to the context
+int FrozenContextTree::findPath(const bool create) {
+	assert(m_history.size() >= size_t(m_depth));
+
+	m_path[0] = 0;
+	size_t h = m_history.size();
+	for (int i = 1; i <= m_depth; i++) {
+		const symbol_t symbol = m_history[--h];
+		uint32_t child = m_nodes[m_path[i - 1]].child[symbol];
+		if (child == 0) {
+			if (!create)
+				return i - 1;
+			assert(m_nodes.size() < size_t(UINT32_MAX));
+			child = uint32_t(m_nodes.size());
+			m_nodes.push_back(frozen_node_t());
+			m_nodes[m_path[i - 1]].child[symbol] = child;
+			m_nodes_created++;
+		}
+		m_path[i] = child;
+	}
+	return m_depth;
+}
+
+
+// The computations of ContextTree::predictContext(), in the same order so
+// that the predictions are the same. Nodes below the path are empty.
+weight_t FrozenContextTree::predictPath(const symbol_t symbol,
+		const int found) const {
+	static const frozen_node_t empty = frozen_node_t();
+
+	weight_t log_probability = 0.0; // ln P_w of the updated child on the path
+	for (int i = m_depth; i >= 0; i--) {
+		frozen_node_t const& node = i <= found ? m_nodes[m_path[i]] : empty;
+		const weight_t log_kt = node.log_kt + logKTMultiplier(node, symbol);
+
+		if (i == m_depth) {
+			log_probability = log_kt;
+		} else {
+			const symbol_t path = m_history[m_history.size() - i - 1];
+			const uint32_t zero = node.child[false];
+			const uint32_t one = node.child[true];
+			double log_child_prob = 0.0;
+			log_child_prob += !path ? log_probability
+				: (zero ? m_nodes[zero].log_probability : 0.0);
+			log_child_prob += path ? log_probability
+				: (one ? m_nodes[one].log_probability : 0.0);
+
+			log_probability = CTNode::logWeightedProbability(log_kt,
+			                                                 log_child_prob);
+		}
+	}
+
+	return std::exp(log_probability - m_nodes[0].log_probability);
+}
+
+
+// The computations of CTNode::update(), from the leaf to the root
+void FrozenContextTree::learnPath(const symbol_t symbol, const size_t size) {
+	m_undo_size.push_back(size);
+	for (int i = 0; i <= m_depth; i++) {
+		frozen_node_t const& node = m_nodes[m_path[i]];
+		frozen_undo_t undo = { m_path[i], node.log_kt, node.log_probability };
+		m_undo.push_back(undo);
+	}
+
+	for (int i = m_depth; i >= 0; i--) {
+		frozen_node_t &node = m_nodes[m_path[i]];
+		node.log_kt += logKTMultiplier(node, symbol);
+		const uint32_t zero = node.child[false];
+		const uint32_t one = node.child[true];
+		if (zero == 0 && one == 0) {
+			node.log_probability = node.log_kt;
+		} else {
+			double log_child_prob = 0.0;
+			log_child_prob += zero ? m_nodes[zero].log_probability : 0.0;
+			log_child_prob += one ? m_nodes[one].log_probability : 0.0;
+			node.log_probability = CTNode::logWeightedProbability(node.log_kt,
+			                                                      log_child_prob);
+		}
+		node.count[symbol]++;
+	}
+}
+
+
+// The same computation as CTNode::ktMultiplier()
+weight_t FrozenContextTree::logKTMultiplier(frozen_node_t const& node,
+		const symbol_t symbol) {
+	double numerator = double(node.count[symbol]) + 0.5;
+	double denominator = double(node.count[0] + node.count[1] + 1);
+	return std::log(numerator / denominator);
+}
+
+
+
+// The root is empty, so its ratio is 1.
+RatioContextTree::RatioContextTree(const int depth) :
+	ContextTree(depth), m_log_block_probability(0.0)
+{
+	m_root->m_beta = 1.0;
+}
+
+
+// Clear tree and history.
+void RatioContextTree::clear(void) {
+	ContextTree::clear();
+	m_root->m_beta = 1.0;
+	m_log_block_probability = 0.0;
+}
+
+
+// Update the tree with a single new symbol.
+void RatioContextTree::update(const symbol_t symbol) {
+	if (m_history.size() >= size_t(m_depth)) {
+		updateContext();
+		m_log_block_probability += std::log(updateNodes(symbol));
+	}
+	updateHistory(symbol);
+}
+
+
+// Revert the most recent update.
+void RatioContextTree::revert(void) {
+	if (m_history.size() == 0)
+		return;
+
+	const symbol_t symbol = m_history.back();
+	m_history.pop_back();
+	if (m_history.size() >= size_t(m_depth)) {
+		updateContext();
+		m_log_block_probability -= std::log(revertNodes(symbol));
+	}
+}
+
+
+// The conditional probability of symbol given the history
+weight_t RatioContextTree::predict(const symbol_t symbol) {
+	if (m_history.size() < size_t(m_depth)) {
+		return 0.5;
+	}
+	findContext();
+	return predictContext(symbol);
+}
+
+
+// Predict and update along the same context, as ContextTree does
+void RatioContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols,
+		const int bits) {
+	symbols.resize(bits);
+	for (int i = 0; i < bits; i++) {
+		if (m_history.size() < size_t(m_depth)) {
+			symbols[i] = rand01() < 0.5;
+			updateHistory(symbols[i]);
+			continue;
+		}
+
+		updateContext();
+		const symbol_t symbol = rand01() < predictContext(true);
+		m_log_block_probability += std::log(updateNodes(symbol));
+		updateHistory(symbol);
+		symbols[i] = symbol;
+	}
+}
+
+
+// Get the nodes in the current context. Nodes which have not been visited
+// (the new ones, and the root of an empty tree) have KT estimates and weighted
+// probabilities of 1.
+void RatioContextTree::updateContext(void) {
+	ContextTree::updateContext();
+	for (int i = 0; i <= m_depth; i++) {
+		if (m_context[i]->visits() == 0)
+			m_context[i]->m_beta = 1.0;
+	}
+}
+
+
+// Propagate the conditional probability from the leaf to the root
+weight_t RatioContextTree::predictContext(const symbol_t symbol) const {
+	weight_t probability = m_context[m_depth]
+		? m_context[m_depth]->ktMultiplier(symbol) : 0.5;
+	for (int i = m_depth - 1; i >= 0; i--) {
+		const CTNode *node = m_context[i];
+		if (node == NULL) {
+			probability = (0.5 + probability) / 2.0;
+			continue;
+		}
+		const weight_t kt = node->ktMultiplier(symbol);
+		probability = (node->m_beta * kt + probability) / (node->m_beta + 1.0);
+	}
+	return probability;
+}
+
+
+// Update the counts and ratios from the leaf to the root. The ratio of a node
+// is updated with the conditional probability at its child.
+weight_t RatioContextTree::updateNodes(const symbol_t symbol) {
+	CTNode *leaf = m_context[m_depth];
+	weight_t probability = leaf->ktMultiplier(symbol);
+	leaf->m_count[symbol]++;
+	for (int i = m_depth - 1; i >= 0; i--) {
+		CTNode *node = m_context[i];
+		const weight_t kt = node->ktMultiplier(symbol);
+		const weight_t beta = node->m_beta;
+		node->m_beta = limitBeta(beta * kt / probability);
+		node->m_count[symbol]++;
+		probability = (beta * kt + probability) / (beta + 1.0);
+	}
+	return probability;
+}
+
+
+// Revert the counts and ratios from the leaf to the root, deleting the child
+// in the context once it is no longer visited.
+weight_t RatioContextTree::revertNodes(const symbol_t symbol) {
+	CTNode *leaf = m_context[m_depth];
+	leaf->m_count[symbol]--;
+	weight_t probability = leaf->ktMultiplier(symbol);
+	for (int i = m_depth - 1; i >= 0; i--) {
+		CTNode *node = m_context[i];
+		node->m_count[symbol]--;
+		if (m_context[i + 1]->visits() == 0) {
+			const symbol_t path = m_history[m_history.size() - i - 1];
+			delete node->m_child[path];
+			node->m_child[path] = NULL;
+		}
+
+		const weight_t kt = node->ktMultiplier(symbol);
+		const weight_t beta = limitBeta(node->m_beta * probability / kt);
+		node->m_beta = beta;
+		probability = (beta * kt + probability) / (beta + 1.0);
+	}
+	return probability;
+}
+
+
+DenseContextTree::DenseContextTree(const int depth, const int dense_depth) :
+	ContextTree(depth, symbol_list_t()), m_nodes(NULL),
+	m_dense_depth(dense_depth)
+{
+	assert(0 <= dense_depth && dense_depth <= depth);
+	allocate();
+}
+
+
+// Delete the array. The root is part of it, so ContextTree must not delete it.
+DenseContextTree::~DenseContextTree(void) {
+	deallocate();
+	m_root = NULL;
+}
+
+
+// Clear tree and history.
+void DenseContextTree::clear(void) {
+	m_history.clear();
+	deallocate();
+	allocate();
+}
+
+
+// Link each node above the bottom level of the array to its children.
+void DenseContextTree::allocate(void) {
+	const size_t size = (size_t(2) << m_dense_depth) - 1;
+	const size_t parents = (size_t(1) << m_dense_depth) - 1;
+	m_nodes = new CTNode[size];
+	for (size_t i = 0; i < parents; i++) {
+		m_nodes[i].m_child[0] = &m_nodes[2 * i + 1];
+		m_nodes[i].m_child[1] = &m_nodes[2 * i + 2];
+	}
+	m_root = m_nodes;
+}
+
+
+// Unlink the children in the array, so the destructor of CTNode only deletes
+// the subtrees below the bottom level.
+void DenseContextTree::deallocate(void) {
+	const size_t parents = (size_t(1) << m_dense_depth) - 1;
+	for (size_t i = 0; i < parents; i++) {
+		m_nodes[i].m_child[0] = NULL;
+		m_nodes[i].m_child[1] = NULL;
+	}
+	delete[] m_nodes;
+	m_nodes = NULL;
+}
+
+
+// Revert the most recent update. The nodes below the array are reverted as in
+// ContextTree, which deletes those no longer needed.
+void DenseContextTree::revert(void) {
+	if (m_history.size() == 0)
+		return;
+
+	const symbol_t symbol = m_history.back();
+	m_history.pop_back();
+	if (m_history.size() >= size_t(m_depth)) {
+		updateContext();
+		for (int i = m_depth; i >= m_dense_depth; i--) {
+			m_context[i]->revert(symbol);
+		}
+		// The nodes of the array are never deleted, so delete the subtree on
+		// the path below the array once it is no longer visited, as the node
+		// above it would in ContextTree
+		if (m_dense_depth < m_depth) {
+			const symbol_t path = m_history[m_history.size() - m_dense_depth - 1];
+			CTNode *&child = m_context[m_dense_depth]->m_child[path];
+			if (child != NULL && child->visits() == 0) {
+				delete child;
+				child = NULL;
+			}
+		}
+		for (int i = m_dense_depth - 1; i >= 0; i--) {
+			CTNode *node = m_context[i];
+			node->m_count[symbol]--;
+			node->m_log_kt -= node->logKTMultiplier(symbol);
+			node->updateLogProbability();
+		}
+	}
+}
+
+
+// The nodes of the array in use, i.e. the root and the visited nodes, as
+// ContextTree::size() counts them, plus the sizes of the subtrees below its
+// bottom level
+size_t DenseContextTree::size(void) const {
+	const size_t size = (size_t(2) << m_dense_depth) - 1;
+	size_t nodes = 1;
+	for (size_t i = 1; i < size; i++) {
+		if (m_nodes[i].visits() > 0)
+			nodes++;
+	}
+	for (size_t i = (size_t(1) << m_dense_depth) - 1; i < size; i++) {
+		for (int s = 0; s < 2; s++) {
+			if (m_nodes[i].m_child[s])
+				nodes += m_nodes[i].m_child[s]->size();
+		}
+	}
+	return nodes;
+}
+
+
+// The deepest level such that the levels above and including it, 2^(d+1) - 1
+// nodes, fit in the memory
+int DenseContextTree::denseDepth(const int depth, const size_t memory) {
+	const size_t nodes = memory / sizeof(CTNode);
+	int dense_depth = -1;
+	while (dense_depth < depth && dense_depth < 62
+			&& (size_t(2) << (dense_depth + 1)) - 1 <= nodes) {
+		dense_depth++;
+	}
+	return dense_depth;
+}
+
+
+// Get the nodes in the current context, creating those below the array
+void DenseContextTree::updateContext(void) {
+	assert(m_history.size() >= size_t(m_depth));
+
+	CTNode *node = denseContext();
+	symbol_list_t::reverse_iterator symbol_iter = m_history.rbegin()
+		+ m_dense_depth;
+	for (int i = m_dense_depth + 1; i <= m_depth; symbol_iter++, i++) {
+		CTNode *&child = node->m_child[*symbol_iter];
+		if (child == NULL) {
+			child = new CTNode();
+			m_nodes_created++;
+		}
+		node = child;
+		m_context[i] = node;
+	}
+}
+
+
+// Find the nodes in the current context without creating missing nodes
+void DenseContextTree::findContext(void) {
+	assert(m_history.size() >= size_t(m_depth));
+
+	denseContext();
+	symbol_list_t::reverse_iterator symbol_iter = m_history.rbegin()
+		+ m_dense_depth;
+	for (int i = m_dense_depth + 1; i <= m_depth; symbol_iter++, i++) {
+		m_context[i] = m_context[i - 1]
+			? m_context[i - 1]->m_child[*symbol_iter] : NULL;
+	}
+}
+
+
+// The index of each node in the array follows from the index of its parent and
+// the symbol of the context at the parent's level.
+CTNode *DenseContextTree::denseContext(void) {
+	size_t index = 0;
+	m_context[0] = m_nodes;
+	symbol_list_t::reverse_iterator symbol_iter = m_history.rbegin();
+	for (int i = 1; i <= m_dense_depth; symbol_iter++, i++) {
+		index = 2 * index + 1 + (*symbol_iter ? 1 : 0);
+		m_context[i] = &m_nodes[index];
+	}
+	return m_context[m_dense_depth];
+}
+
+
+
+
+SymbolCTNode::SymbolCTNode(void) :
+	m_log_kt(0.0), m_log_probability(0.0), m_log_children(0.0), m_visits(0)
+{
+}
+
+
+// Delete child nodes.
+SymbolCTNode::~SymbolCTNode(void) {
+	for (size_t i = 0; i < m_children.size(); i++)
+		delete m_children[i].second;
+}
+
+
+// The number of descendants plus one.
+int SymbolCTNode::size(void) const {
+	int nodes = 1;
+	for (size_t i = 0; i < m_children.size(); i++)
+		nodes += m_children[i].second->size();
+	return nodes;
+}
+
+
+// The count of a symbol, 0 if it has not occurred
+int SymbolCTNode::count(const interaction_t symbol) const {
+	for (size_t i = 0; i < m_counts.size(); i++) {
+		if (m_counts[i].first == symbol)
+			return m_counts[i].second;
+	}
+	return 0;
+}
+
+
+// Symbols whose counts drop to 0 are removed.
+void SymbolCTNode::addCount(const interaction_t symbol, const int delta) {
+	m_visits += delta;
+	for (size_t i = 0; i < m_counts.size(); i++) {
+		if (m_counts[i].first == symbol) {
+			m_counts[i].second += delta;
+			if (m_counts[i].second == 0) {
+				m_counts[i] = m_counts.back();
+				m_counts.pop_back();
+			}
+			return;
+		}
+	}
+	assert(delta > 0);
+	m_counts.push_back(std::make_pair(symbol, delta));
+}
+
+
+// The KT estimate of the probability of the next symbol.
+weight_t SymbolCTNode::ktMultiplier(const interaction_t symbol,
+		const int alphabet) const {
+	return (double(count(symbol)) + 0.5)
+		/ (double(m_visits) + 0.5 * double(alphabet));
+}
+
+
+// The child for a value of the context symbol
+SymbolCTNode *SymbolCTNode::child(const interaction_t symbol) const {
+	for (size_t i = 0; i < m_children.size(); i++) {
+		if (m_children[i].first == symbol)
+			return m_children[i].second;
+	}
+	return NULL;
+}
+
+
+
+
+// Divide the fields into symbols, and give each symbol position a context of
+// the preceding symbols covering the depth.
+SymbolContextTree::SymbolContextTree(const int depth, const int symbol_bits,
+		std::vector<int> const& fields) :
+	ContextTree(depth, symbol_list_t()), m_cycle_bits(0),
+	m_distribution_start(-1)
+{
+	assert(0 < symbol_bits && symbol_bits <= 16);
+	for (size_t f = 0; f < fields.size(); f++) {
+		for (int b = 0; b < fields[f]; b += symbol_bits) {
+			const int bits = std::min(symbol_bits, fields[f] - b);
+			m_symbol_offset.push_back(m_cycle_bits);
+			m_symbol_bits.push_back(bits);
+			m_bit_position.insert(m_bit_position.end(), bits,
+			                      int(m_symbol_bits.size()) - 1);
+			m_cycle_bits += bits;
+		}
+	}
+	assert(m_cycle_bits > 0);
+
+	const int positions = int(m_symbol_bits.size());
+	int max_depth = 0;
+	for (int j = 0; j < positions; j++) {
+		int symbols = 0, bits = 0;
+		for (int k = j; bits < depth; symbols++) {
+			k = (k + positions - 1) % positions;
+			bits += m_symbol_bits[k];
+		}
+		m_symbol_depth.push_back(symbols);
+		m_context_bits.push_back(bits);
+		max_depth = std::max(max_depth, symbols);
+		m_roots.push_back(new SymbolCTNode());
+	}
+	m_path.resize(max_depth + 1);
+}
+
+
+// Delete the trees.
+SymbolContextTree::~SymbolContextTree(void) {
+	for (size_t j = 0; j < m_roots.size(); j++)
+		delete m_roots[j];
+}
+
+
+// Clear trees and history.
+void SymbolContextTree::clear(void) {
+	m_history.clear();
+	m_learnt.clear();
+	for (size_t j = 0; j < m_roots.size(); j++) {
+		delete m_roots[j];
+		m_roots[j] = new SymbolCTNode();
+	}
+	m_distribution_start = -1;
+}
+
+
+// Add a bit, learning the symbol it completes.
+void SymbolContextTree::update(const symbol_t symbol) {
+	size_t start;
+	const int j = position(m_history.size(), start);
+	m_history.push_back(symbol);
+	m_learnt.push_back(true);
+	if (m_history.size() - start == size_t(m_symbol_bits[j]))
+		updateSymbol(j, start, true);
+}
+
+
+// Add a bit without learning.
+void SymbolContextTree::updateHistory(const symbol_t symbol) {
+	m_history.push_back(symbol);
+	m_learnt.push_back(false);
+}
+
+
+// Remove the most recent bit, unlearning the symbol it completed.
+void SymbolContextTree::revert(void) {
+	if (m_history.size() == 0)
+		return;
+
+	size_t start;
+	const int j = position(m_history.size() - 1, start);
+	if (m_learnt.back()
+			&& m_history.size() - start == size_t(m_symbol_bits[j]))
+		updateSymbol(j, start, false);
+	revertHistory(1);
+}
+
+
+// Shrink the history without affecting the trees
+void SymbolContextTree::revertHistory(const int num_symbols) {
+	assert(0 <= num_symbols && size_t(num_symbols) <= m_history.size());
+	m_history.resize(m_history.size() - num_symbols);
+	m_learnt.resize(m_history.size());
+	if ((long long)(m_history.size()) < m_distribution_start)
+		m_distribution_start = -1;
+}
+
+
+// The probability of the next bit, from the distribution of the symbol it
+// belongs to given the bits of the symbol seen so far
+weight_t SymbolContextTree::predict(const symbol_t symbol) {
+	size_t start;
+	const int j = position(m_history.size(), start);
+	if (!distribution(j, start))
+		return 0.5;
+
+	const int seen = int(m_history.size() - start);
+	const interaction_t prefix = value(start, seen);
+	const interaction_t alphabet = interaction_t(1) << m_symbol_bits[j];
+	weight_t total = 0.0, ones = 0.0;
+	for (interaction_t x = prefix; x < alphabet; x += interaction_t(1) << seen) {
+		total += m_distribution[x];
+		if ((x >> seen) & 1)
+			ones += m_distribution[x];
+	}
+	return symbol ? ones / total : 1.0 - ones / total;
+}
+
+
+// Sample whole symbols from their distributions where possible, and single
+// bits otherwise (at the start and end of a partial symbol, or without
+// enough context)
+void SymbolContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols,
+		const int bits) {
+	symbols.resize(bits);
+	int i = 0;
+	while (i < bits) {
+		size_t start;
+		const int j = position(m_history.size(), start);
+		const int width = m_symbol_bits[j];
+		if (start != m_history.size() || width > bits - i
+				|| !distribution(j, start)) {
+			const symbol_t symbol = rand01() < predict(true);
+			update(symbol);
+			symbols[i++] = symbol;
+			continue;
+		}
+
+		const interaction_t alphabet = interaction_t(1) << width;
+		double u = rand01();
+		interaction_t x = 0;
+		for ( ; x < alphabet - 1; x++) {
+			u -= m_distribution[x];
+			if (u < 0.0)
+				break;
+		}
+		for (int k = 0; k < width; k++) {
+			const symbol_t symbol = (x >> k) & 1;
+			m_history.push_back(symbol);
+			m_learnt.push_back(true);
+			symbols[i++] = symbol;
+		}
+		updateSymbol(j, start, true);
+	}
+}
+
+
+// The product of the probabilities of the trees
+double SymbolContextTree::logBlockProbability(void) const {
+	double log_probability = 0.0;
+	for (size_t j = 0; j < m_roots.size(); j++)
+		log_probability += m_roots[j]->m_log_probability;
+	return log_probability;
+}
+
+
+// The nodes of all the trees
+size_t SymbolContextTree::size(void) const {
+	size_t nodes = 0;
+	for (size_t j = 0; j < m_roots.size(); j++)
+		nodes += m_roots[j]->size();
+	return nodes;
+}
+
+
+// The cycles start at the beginning of the history.
+int SymbolContextTree::position(const size_t index, size_t &start) const {
+	const int bit = int(index % m_cycle_bits);
+	const int j = m_bit_position[bit];
+	start = index - (bit - m_symbol_offset[j]);
+	return j;
+}
+
+
+// Symbols are encoded with the least significant bit first, as by encode().
+interaction_t SymbolContextTree::value(const size_t start,
+		const int bits) const {
+	interaction_t symbol = 0;
+	for (int k = 0; k < bits; k++) {
+		if (m_history[start + k])
+			symbol |= interaction_t(1) << k;
+	}
+	return symbol;
+}
+
+
+// Walk back through the preceding symbols, descending into the child for the
+// value of each.
+bool SymbolContextTree::findPath(const int position, const size_t start,
+		const bool create) {
+	if (start < size_t(m_context_bits[position]))
+		return false;
+
+	const int positions = int(m_symbol_bits.size());
+	size_t bit = start;
+	int k = position;
+	m_path[0] = m_roots[position];
+	for (int i = 1; i <= m_symbol_depth[position]; i++) {
+		k = (k + positions - 1) % positions;
+		bit -= m_symbol_bits[k];
+		const interaction_t symbol = value(bit, m_symbol_bits[k]);
+		SymbolCTNode *parent = m_path[i - 1];
+		SymbolCTNode *node = parent ? parent->child(symbol) : NULL;
+		if (node == NULL && create) {
+			node = new SymbolCTNode();
+			parent->m_children.push_back(std::make_pair(symbol, node));
+			m_nodes_created++;
+		}
+		m_path[i] = node;
+	}
+	return true;
+}
+
+
+// Update the nodes from the leaf to the root as CTNode::update() and
+// CTNode::revert() do, passing the change of each weighted probability on to
+// the sum kept by the parent.
+void SymbolContextTree::updateSymbol(const int position, const size_t start,
+		const bool learn) {
+	if (!findPath(position, start, learn))
+		return;
+	m_distribution_start = -1;
+
+	const int bits = m_symbol_bits[position];
+	const int alphabet = 1 << bits;
+	const interaction_t symbol = value(start, bits);
+	const int depth = m_symbol_depth[position];
+	for (int i = depth; i >= 0; i--) {
+		SymbolCTNode *node = m_path[i];
+		assert(node != NULL);
+		const weight_t log_probability = node->m_log_probability;
+		if (learn) {
+			node->m_log_kt += std::log(node->ktMultiplier(symbol, alphabet));
+			node->addCount(symbol, 1);
+		} else {
+			node->addCount(symbol, -1);
+			node->m_log_kt -= std::log(node->ktMultiplier(symbol, alphabet));
+
+			// Delete the child in the context once it is no longer visited
+			if (i < depth && m_path[i + 1]->m_visits == 0) {
+				std::vector<std::pair<interaction_t, SymbolCTNode*> >
+					&children = node->m_children;
+				for (size_t c = 0; c < children.size(); c++) {
+					if (children[c].second == m_path[i + 1]) {
+						children[c] = children.back();
+						children.pop_back();
+						break;
+					}
+				}
+				node->m_log_children -= m_path[i + 1]->m_log_probability;
+				delete m_path[i + 1];
+			}
+		}
+
+		if (node->m_children.empty()) {
+			node->m_log_children = 0.0;
+			node->m_log_probability = node->m_log_kt;
+		} else {
+			node->m_log_probability = CTNode::logWeightedProbability(
+				node->m_log_kt, node->m_log_children);
+		}
+		if (i > 0) {
+			m_path[i - 1]->m_log_children +=
+				node->m_log_probability - log_probability;
+		}
+	}
+}
+
+
+// Propagate the distribution from the leaf to the root. A node mixes its KT
+// estimate into the distribution of its child with weight
+// Pr_kt / (Pr_kt + P_w^children) = 1 / (1 + exp(-ln beta)), where beta is the
+// ratio used by RatioContextTree. Missing nodes are empty nodes, whose KT
+// estimate is uniform and whose weight is 1/2.
+bool SymbolContextTree::distribution(const int position, const size_t start) {
+	if (m_distribution_start == (long long)(start))
+		return true;
+	if (!findPath(position, start, false))
+		return false;
+
+	const int alphabet = 1 << m_symbol_bits[position];
+	const int depth = m_symbol_depth[position];
+	m_distribution.assign(alphabet, 1.0 / alphabet);
+	for (int i = depth; i >= 0; i--) {
+		const SymbolCTNode *node = m_path[i];
+		if (node == NULL) {
+			if (i < depth) {
+				for (int x = 0; x < alphabet; x++)
+					m_distribution[x] = 0.5 / alphabet + 0.5 * m_distribution[x];
+			}
+			continue;
+		}
+
+		// The weight of the KT estimate, which is all there is at the leaf
+		const double weight = i == depth ? 1.0
+			: 1.0 / (1.0 + std::exp(node->m_log_children - node->m_log_kt));
+		const double denominator = double(node->m_visits) + 0.5 * alphabet;
+		const double kt = weight * 0.5 / denominator;
+		for (int x = 0; x < alphabet; x++)
+			m_distribution[x] = kt + (1.0 - weight) * m_distribution[x];
+		for (size_t c = 0; c < node->m_counts.size(); c++) {
+			m_distribution[node->m_counts[c].first] +=
+				weight * node->m_counts[c].second / denominator;
+		}
+	}
+	m_distribution_start = (long long)(start);
+	return true;
+}
+
+
+
+
+// One empty tree for each bit position of the cycle
+FactoredContextTree::FactoredContextTree(const int depth, const int cycle_bits,
+		const int threads) :
+	ContextTree(depth, symbol_list_t()), m_threads(threads), m_pool(NULL)
+{
+	assert(cycle_bits > 0 && threads > 0);
+	for (int i = 0; i < cycle_bits; i++)
+		m_roots.push_back(new CTNode());
+	m_root = m_roots[0];
+	if (m_threads > 1) {
+		m_pool = new WorkerPool(m_threads, 0);
+		m_contexts.assign(m_threads, std::vector<CTNode*>(m_depth + 1));
+	}
+}
+
+
+// Delete the trees. ContextTree must not delete the current one again.
+FactoredContextTree::~FactoredContextTree(void) {
+	delete m_pool;
+	for (size_t i = 0; i < m_roots.size(); i++)
+		delete m_roots[i];
+	m_root = NULL;
+}
+
+
+// Clear trees and history.
+void FactoredContextTree::clear(void) {
+	m_history.clear();
+	for (size_t i = 0; i < m_roots.size(); i++) {
+		delete m_roots[i];
+		m_roots[i] = new CTNode();
+	}
+	m_root = m_roots[0];
+}
+
+
+// Update the tree of the next bit.
+void FactoredContextTree::update(const symbol_t symbol) {
+	selectTree(m_history.size());
+	ContextTree::update(symbol);
+}
+
+
+// Append the symbols to the history first, so that it does not change while
+// the threads of the pool read it. Each thread learns every so many symbols.
+void FactoredContextTree::updateInParallel(symbol_list_t const& symbols) {
+	const size_t first = m_history.size();
+	m_history.insert(m_history.end(), symbols.begin(), symbols.end());
+
+	if (m_pool == NULL || symbols.size() <= 1) {
+		for (size_t i = 0; i < symbols.size(); i++)
+			m_nodes_created += learn(first + i, m_context);
+		return;
+	}
+
+	const size_t threads = m_pool->size();
+	std::vector<size_t> created(threads, 0);
+	m_pool->run([this, &symbols, &created, first, threads](size_t t) {
+		for (size_t i = t; i < symbols.size(); i += threads)
+			created[t] += learn(first + i, &m_contexts[t][0]);
+	});
+	for (size_t t = 0; t < threads; t++)
+		m_nodes_created += created[t];
+}
+
+
+// Revert the tree of the most recent bit.
+void FactoredContextTree::revert(void) {
+	if (m_history.size() == 0)
+		return;
+	selectTree(m_history.size() - 1);
+	ContextTree::revert();
+}
+
+
+// Predict with the tree of the next bit.
+weight_t FactoredContextTree::predict(const symbol_t symbol) {
+	selectTree(m_history.size());
+	return ContextTree::predict(symbol);
+}
+
+
+// Sample each bit with its tree, predicting and updating along the same
+// context as ContextTree does
+void FactoredContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols,
+		const int bits) {
+	symbols.resize(bits);
+	symbol_list_t symbol;
+	for (int i = 0; i < bits; i++) {
+		selectTree(m_history.size());
+		ContextTree::genRandomSymbolsAndUpdate(symbol, 1);
+		symbols[i] = symbol[0];
+	}
+}
+
+
+// The product of the probabilities of the trees
+double FactoredContextTree::logBlockProbability(void) const {
+	double log_probability = 0.0;
+	for (size_t i = 0; i < m_roots.size(); i++)
+		log_probability += m_roots[i]->logProbability();
+	return log_probability;
+}
+
+
+// The nodes of all the trees
+size_t FactoredContextTree::size(void) const {
+	size_t nodes = 0;
+	for (size_t i = 0; i < m_roots.size(); i++)
+		nodes += m_roots[i]->size();
+	return nodes;
+}
+
+
+// The cycles start at the beginning of the history.
+void FactoredContextTree::selectTree(const size_t index) {
+	m_root = m_roots[index % m_roots.size()];
+}
+
+
+// Find or create the nodes of the context from the root of the bit's tree,
+// and update them from the leaf, as ContextTree::update() does
+size_t FactoredContextTree::learn(const size_t index, CTNode **context) {
+	if (index < size_t(m_depth))
+		return 0;
+
+	size_t created = 0;
+	CTNode *node = m_roots[index % m_roots.size()];
+	context[0] = node;
+	for (int i = 1; i <= m_depth; i++) {
+		CTNode *&child = node->m_child[m_history[index - i]];
+		if (child == NULL) {
+			child = new CTNode();
+			created++;
+		}
+		node = child;
+		context[i] = node;
+	}
+
+	const symbol_t symbol = m_history[index];
+	for (int i = m_depth; i >= 0; i--)
+		context[i]->update(symbol);
+	return created;
+}
+
+
+
+
+/** The number of locks of a ::SharedContextTree. */
+static const size_t shared_locks = 1024;
+
+SharedContextTree::SharedContextTree(const int depth) :
+	ContextTree(depth), m_owner(true),
+	m_locks(new std::vector<std::mutex>(shared_locks))
+{
+}
+
+
+// Share the nodes and locks of the owner, with an empty history.
+SharedContextTree::SharedContextTree(SharedContextTree const& owner) :
+	ContextTree(int(owner.depth()), symbol_list_t()), m_owner(false),
+	m_locks(owner.m_locks)
+{
+	m_root = owner.m_root;
+}
+
+
+// Leave the nodes and locks to the owner.
+SharedContextTree::~SharedContextTree(void) {
+	if (!m_owner)
+		m_root = NULL;
+	else
+		delete m_locks;
+}
+
+
+// Clear the history only.
+void SharedContextTree::clear(void) {
+	m_history.clear();
+}
+
+
+// Update the tree with a new symbol, while other instances may do the same.
+void SharedContextTree::update(const symbol_t symbol) {
+	if (m_history.size() >= size_t(m_depth)) {
+		// Find the nodes of the context, creating missing children under the
+		// lock of their parent
+		m_context[0] = m_root;
+		symbol_list_t::reverse_iterator symbol_iter = m_history.rbegin();
+		for (int i = 1; i <= m_depth; symbol_iter++, i++) {
+			CTNode *parent = m_context[i - 1];
+			std::lock_guard<std::mutex> guard(lock(parent));
+			CTNode *&child = parent->m_child[*symbol_iter];
+			if (child == NULL) {
+				child = new CTNode();
+				m_nodes_created++;
+			}
+			m_context[i] = child;
+		}
+
+		for (int i = m_depth; i >= 0; i--)
+			learn(m_context[i], symbol);
+	}
+
+	updateHistory(symbol);
+}
+
+
+// Revert the most recent update of this instance, while other instances may
+// update the tree. Nodes are kept even when no longer visited, as other
+// instances may hold them in their context.
+void SharedContextTree::revert(void) {
+	if (m_history.empty())
+		return;
+
+	const symbol_t symbol = m_history.back();
+	m_history.pop_back();
+
+	if (m_history.size() >= size_t(m_depth)) {
+		// The nodes of the context were created by the update being reverted
+		m_context[0] = m_root;
+		symbol_list_t::reverse_iterator symbol_iter = m_history.rbegin();
+		for (int i = 1; i <= m_depth; symbol_iter++, i++) {
+			CTNode *parent = m_context[i - 1];
+			std::lock_guard<std::mutex> guard(lock(parent));
+			m_context[i] = parent->m_child[*symbol_iter];
+			assert(m_context[i] != NULL);
+		}
+
+		for (int i = m_depth; i >= 0; i--)
+			learn(m_context[i], symbol, true);
+	}
+}
+
+
+// The lock of the stripe the node's address falls in
+std::mutex &SharedContextTree::lock(const CTNode *node) const {
+	const size_t hash = size_t(node) / sizeof(CTNode);
+	return (*m_locks)[hash % m_locks->size()];
+}
+
+
+// Update or revert a node with the locks of the node and its children. The
+// locks are taken in the order of their addresses, so that threads cannot
+// deadlock.
+void SharedContextTree::learn(CTNode *node, const symbol_t symbol,
+		const bool undo) {
+	std::mutex *held[3];
+	int locks = 0;
+	held[locks++] = &lock(node);
+	for (int c = 0; c < 2; c++) {
+		if (node->m_child[c] != NULL)
+			held[locks++] = &lock(node->m_child[c]);
+	}
+	for (int i = 1; i < locks; i++) {
+		for (int j = i; j > 0 && held[j] < held[j - 1]; j--)
+			std::swap(held[j], held[j - 1]);
+	}
+	locks = int(std::unique(held, held + locks) - held);
+
+	for (int i = 0; i < locks; i++)
+		held[i]->lock();
+
+	if (!undo) {
+		node->update(symbol);
+	} else {
+		node->m_count[symbol]--;
+		node->m_log_kt -= node->logKTMultiplier(symbol);
+		node->updateLogProbability();
+	}
+
+	for (int i = locks - 1; i >= 0; i--)
+		held[i]->unlock();
+}
@@ -1,5 +1,8 @@
 #ifndef __PREDICT_HPP__
 #define __PREDICT_HPP__
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include "main.hpp"
 
@@ -9,6 +12,15 @@ typedef int count_t;
 /** Holds context weights. */
 typedef double weight_t;
 
+class PersistentCTNode;
+class WorkerPool;
+
+/** A version of the nodes of a ::PersistentContextTree, i.e. its root node. */
+typedef const PersistentCTNode *ct_version_t;
+
+/** Holds hashes of contexts. */
+typedef unsigned long long context_hash_t;
+
 /** The ::CTNode class represents a node in an action-conditional context tree. The
  * purpose of each node is to calculate the weighted probability of observing
  * a particular bit sequence. In particular, denote by \f$ n \f$ the
@@ -74,6 +86,38 @@ class CTNode {
 	 *    nodes from the context tree. */
 	friend class ContextTree;
 
+	/** The ::OverlayContextTree class keeps its own copies of nodes, which it
+	 * updates in the same way as the ::ContextTree class. */
+	friend class OverlayContextTree;
+
+	/** The ::PersistentContextTree class shares nodes between versions of
+	 * the tree, and updates them in the same way as the ::ContextTree
+	 * class. */
+	friend class PersistentContextTree;
+
+	/** The ::FrozenContextTree class compiles nodes into a single array. */
+	friend class FrozenContextTree;
+
+	/** The ::RatioContextTree class stores a ratio of probabilities in the
+	 * nodes instead of log probabilities. */
+	friend class RatioContextTree;
+
+	/** The ::DenseContextTree class stores the top levels of its nodes in a
+	 * single array. */
+	friend class DenseContextTree;
+
+	/** The ::SymbolContextTree class weights its nodes in the same way as
+	 * the ::ContextTree class. */
+	friend class SymbolContextTree;
+
+	/** The ::FactoredContextTree class learns several symbols at the same
+	 * time in the same way as the ::ContextTree class. */
+	friend class FactoredContextTree;
+
+	/** The ::SharedContextTree class updates nodes from several threads at
+	 * the same time, taking locks. */
+	friend class SharedContextTree;
+
 public:
 
 	/** Retrieves the cached KT estimate of the log probability of the history
@@ -118,7 +162,7 @@ public:
 	int visits(void) const { return m_count[false] + m_count[true]; }
 
 
-private:
+protected:
 	/** Initialise the node. */
 	CTNode(void);
 
@@ -126,6 +170,7 @@ private:
 	/** Destroy the node and all children. */
 	~CTNode(void);
 
+private:
 
 	/** Compute the logarithm of the KT-estimator update multiplier. The
 	 * log KT estimate of the conditional probability of observing a zero given
@@ -148,6 +193,15 @@ private:
 	weight_t logKTMultiplier(const symbol_t symbol) const;
 
 
+	/** The KT estimate of the conditional probability of observing a
+	 * symbol, \f$ \Pr_\text{kt}(0 \,|\, 0^a1^b) \f$ or
+	 * \f$ \Pr_\text{kt}(1 \,|\, 0^a1^b) \f$ (see
+	 * CTNode::logKTMultiplier()).
+	 * \param symbol The symbol.
+	 * \return The KT estimate of the conditional probability. */
+	weight_t ktMultiplier(const symbol_t symbol) const;
+
+
 	/** Calculates the logarithm of the weighted block probability
 	 * \f[
 	 *     \ln P^n_w :=
@@ -188,6 +242,17 @@ private:
 	void updateLogProbability(void);
 
 
+	/** Calculates the logarithm of the weighted block probability of a node
+	 * which is not a leaf node, as described for
+	 * CTNode::updateLogProbability().
+	 * \param log_kt The log KT estimate of the node.
+	 * \param log_child_prob The sum of the log weighted probabilities of the
+	 *     child nodes.
+	 * \return The log weighted probability. */
+	static weight_t logWeightedProbability(weight_t log_kt,
+	                                       weight_t log_child_prob);
+
+
 	/** Update the node after having observed a new symbol. This involves
 	 * updating the symbol counts and recalculating the cached probabilities.
 	 * \param The symbol that was observed. */
@@ -205,8 +270,14 @@ private:
 	weight_t m_log_kt;
 
 
-	/** The cached weighted log probability for this node. */
-	weight_t m_log_probability;
+	union {
+		/** The cached weighted log probability for this node. */
+		weight_t m_log_probability;
+
+		/** The ratio of probabilities stored by a ::RatioContextTree in
+		 * place of CTNode::m_log_probability. */
+		weight_t m_beta;
+	};
 
 
 	/** The number of zeros (CTNode::m_count[0]) and ones (CTNode::m_count[1])
@@ -245,6 +316,9 @@ private:
  *     updating the tree with each bit as it is sampled, then reverting all the
  *     updates so that the tree is in the same state as it was before the
  *     sampling.
+ *
+ * The methods which update, revert or read the nodes of the tree are virtual,
+ * so that a subclass (::OverlayContextTree) can store its nodes differently.
  */
 class ContextTree {
 public:
@@ -257,18 +331,18 @@ public:
 
 
 	/** Destroy the context tree and all the nodes referenced by the tree. */
-	~ContextTree(void);
+	virtual ~ContextTree(void);
 
 
 	/** Clears the entire context tree including all nodes and history. */
-	void clear(void);
+	virtual void clear(void);
 
 
 	/** Update the context tree with a new binary symbol. Recalculate the
 	 * log weighted probabilities and log KT estimates for each affected node.
 	 *
 	 * \param symbol The symbol with which to update the tree. */
-	void update(const symbol_t symbol);
+	virtual void update(const symbol_t symbol);
 
 
 	/** Update the context tree with a list of symbols. Equivalent to calling
@@ -282,7 +356,7 @@ public:
 	/** Append a symbol to the history without updating the context tree.
 	 *
 	 * \param symbol The symbol to add to the history. */
-	void updateHistory(const symbol_t symbol);
+	virtual void updateHistory(const symbol_t symbol);
 
 
 	/** Append symbols to the history without updating the context tree.
@@ -291,9 +365,26 @@ public:
 	void updateHistory(symbol_list_t const& symbols);
 
 
+	/** Append a long list of symbols to the history, learning some of them,
+	 * with several threads. Equivalent to calling ContextTree::update() for
+	 * each learnt symbol and ContextTree::updateHistory() for the others.
+	 *
+	 * The nodes below the first few levels of the tree are split into
+	 * subtrees by the bits of their contexts. Each thread learns the symbols
+	 * of its subtrees, and the probabilities of the levels above them are
+	 * recomputed at the end. With more than one thread, the nodes must be
+	 * stored as ::ContextTree stores them.
+	 *
+	 * \param symbols The symbols to add to the history.
+	 * \param learn Whether each symbol is learnt.
+	 * \param threads The number of threads. */
+	void updateInBulk(symbol_list_t const& symbols,
+	                  symbol_list_t const& learn, const int threads);
+
+
 	/** Restores the context tree to as it was immediately prior to the previous
 	 * update (CTNode::update()). */
-	void revert(void);
+	virtual void revert(void);
 
 
 	/** Restores the context tree to its state prior to a specified number of
@@ -303,7 +394,7 @@ public:
 
 	/** Shrinks the history down to a former size without changing the context
 	 * tree. */
-	void revertHistory(const int num_symbols);
+	virtual void revertHistory(const int num_symbols);
 
 
 	/** The estimated probability of observing a particular symbol. Given a
@@ -316,7 +407,7 @@ public:
 	 * \param symbol The symbol to estimate the conditional probability of. A
 	 * false value corresponds to \f$ \rho(0 | h) \f$ and a true value to
 	 * \f$ \rho(1 | h) \f$. */
-	weight_t predict(const symbol_t symbol);
+	virtual weight_t predict(const symbol_t symbol);
 
 
 	/** The estimated probability of observing a particular sequence of symbols.
@@ -345,11 +436,18 @@ public:
 	 *
 	 * \param symbols Stores the generated string.
 	 * \param bits The number of bits to generate. */
-	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, const int bits);
+	virtual void genRandomSymbolsAndUpdate(symbol_list_t &symbols,
+	                                       const int bits);
 
 
 	/** The logarithm of the block probability of the history sequence. */
-	double logBlockProbability(void) const;
+	virtual double logBlockProbability(void) const;
+
+
+	/** A hash of the current context, i.e. the most recent ContextTree::depth()
+	 * symbols of the history (or the whole history if it is shorter). Equal
+	 * contexts lead to the same path through the context tree. */
+	context_hash_t contextHash(void) const;
 
 
 	/** \return The maximum depth of the context tree. */
@@ -358,17 +456,59 @@ public:
 	/** \return The size of the stored history. */
 	size_t historySize(void) const { return m_history.size(); }
 
+	/** \return The stored history. */
+	symbol_list_t const& history(void) const { return m_history; }
+
+	/** \return The number of nodes created since the context tree was
+	 * constructed. */
+	size_t nodesCreated(void) const { return m_nodes_created; }
+
 	/** \return number of nodes in the context tree. */
-	size_t size(void) const { return m_root ? m_root->size() : 0; }
+	virtual size_t size(void) const { return m_root ? m_root->size() : 0; }
 
-private:
+	/** \return The root node of the context tree. */
+	const CTNode *root(void) const { return m_root; }
+
+protected:
+
+	/** Create a context tree with a given history but without any nodes, for
+	 * subclasses which store their nodes elsewhere.
+	 *
+	 * \param depth The maximum depth of the context tree.
+	 * \param history The history. */
+	ContextTree(const int depth, symbol_list_t const& history);
 
 	/** Calculates which nodes in the context tree correspond to the current
 	 * context and adds them to CTNode::m_context in order from root to leaf. In
 	 * particular, ContextTree::m_context[0] will always correspond to the roo
 	 * node and ContextTree::m_context [m_depth] corresponds to the relevant
 	 * leaf node. Creates the nodes if they do not exist. */
-	void updateContext(void);
+	virtual void updateContext(void);
+
+	/** Like ContextTree::updateContext(), but missing nodes are not created.
+	 * Instead, they and the nodes below them are set to NULL. */
+	virtual void findContext(void);
+
+private:
+
+	/** Calculates the probability that the next symbol is a particular
+	 * symbol given the nodes of the current context, which must have been
+	 * found by ContextTree::updateContext() or ContextTree::findContext().
+	 * The result is the same as updating the context tree with the symbol
+	 * and reverting it again, but the context tree is not changed.
+	 * \param symbol The symbol to predict.
+	 * \return The conditional probability of the symbol. */
+	weight_t predictContext(const symbol_t symbol) const;
+
+	/** Recompute the log weighted probabilities of the nodes above a level
+	 * of the tree, for ContextTree::updateInBulk().
+	 * \param node The node at which to start.
+	 * \param level The level of the node.
+	 * \param split The level from which the probabilities are correct. */
+	static void updateTopLevels(CTNode *node, const int level,
+	                            const int split);
+
+protected:
 
 	/** An array of length CTNode::m_depth + 1 used to hold the nodes in the
 	 * context tree that correspond to the current context. It is important to
@@ -385,6 +525,936 @@ private:
 	/** The maximum depth of the context tree. */
 	int m_depth;
 
+	/** The number of nodes created since the context tree was constructed. */
+	size_t m_nodes_created;
+
+};
+
+
+/** A context tree which is updated without changing another, shared context
+ * tree (the base). The overlay starts out in the state of the base. Nodes of
+ * the base that are updated are first copied into a hash map
+ * (OverlayContextTree::m_copies), and nodes that the base does not have are
+ * created in the overlay only, as children of the copies. The base is only
+ * read, so any number of overlays, each used by a single thread, can share a
+ * base without copying it or taking locks, as long as the base itself is not
+ * changed in the meantime.
+ *
+ * Reverting the overlay to the state of the base simply discards the copies.
+ * Reverts are therefore deferred (OverlayContextTree::m_pending) until the
+ * overlay is next used: if by then the history has shrunk back to the point
+ * where the overlay had no updates (initially the history of the base), no
+ * node needs to be reverted at all. Otherwise the pending reverts are applied
+ * as in ::ContextTree, except that nodes of the base are never deleted. The
+ * updates of the base cannot be reverted by the overlay, but symbols added
+ * only to the history of the overlay can be. */
+class OverlayContextTree : public ContextTree {
+public:
+
+	/** Create an overlay in the state of a context tree.
+	 *
+	 * \param base The context tree to share. It must not be changed while
+	 *     the overlay is in use. */
+	OverlayContextTree(ContextTree const& base);
+
+
+	/** Destroy the overlay. The base is left unchanged. */
+	~OverlayContextTree(void);
+
+
+	/** Discard all updates of the overlay, restoring the current state of
+	 * the base (including its history). */
+	void clear(void);
+
+
+	/** Like ContextTree::update(), without changing the base. */
+	void update(const symbol_t symbol);
+
+
+	/** Like ContextTree::updateHistory(). */
+	void updateHistory(const symbol_t symbol);
+
+
+	/** Like ContextTree::revert(), but only for updates of the overlay. The
+	 * revert is deferred (see OverlayContextTree::m_pending). Reverting an
+	 * update of the base only removes its symbol from the history. */
+	void revert(void);
+
+
+	/** Like ContextTree::revertHistory(). The history may only shrink below
+	 * that of the base while the overlay has no updates. */
+	void revertHistory(const int num_symbols);
+
+
+	/** Like ContextTree::predict(const symbol_t). */
+	weight_t predict(const symbol_t symbol);
+
+
+	/** Like ContextTree::genRandomSymbolsAndUpdate(), without changing the
+	 * base. */
+	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, const int bits);
+
+
+	/** Like ContextTree::logBlockProbability(). */
+	double logBlockProbability(void) const;
+
+
+	/** \return The number of nodes in the base plus the number of nodes
+	 * created in the overlay. */
+	size_t size(void) const;
+
+private:
+
+	/** Discard the copies and created nodes, once the history has shrunk to
+	 * OverlayContextTree::m_clean_size. */
+	void discard(void);
+
+	/** Apply the pending reverts. */
+	void sync(void);
+
+	/** The copy of a node of the base, or NULL if it has not been copied.
+	 * \param base The node of the base. */
+	CTNode *copy(const CTNode *base) const;
+
+	/** Copy a node of the base into OverlayContextTree::m_copies.
+	 * \param base The node of the base.
+	 * \return The copy, without children. */
+	CTNode *makeCopy(const CTNode *base);
+
+	/** Fill OverlayContextTree::m_base_context and ContextTree::m_context
+	 * with the nodes of the current context, similarly to
+	 * ContextTree::updateContext(). If create is set, the nodes of the base
+	 * are copied and missing nodes are created, otherwise missing nodes and
+	 * nodes which have not been copied are set to NULL in
+	 * ContextTree::m_context.
+	 * \param create Whether to copy and create nodes. */
+	void overlayContext(const bool create);
+
+	/** The current state of a child of a node in the current context: its
+	 * copy, the node of the base, or the node created in the overlay.
+	 * \param level The level of the parent node in the current context.
+	 * \param symbol The symbol corresponding to the child.
+	 * \return The child, or NULL if there is no such child. */
+	const CTNode *child(const int level, const symbol_t symbol) const;
+
+	/** Recalculate the log weighted probability of a node in the current
+	 * context, as CTNode::updateLogProbability() does.
+	 * \param level The level of the node in the current context. */
+	void updateLogProbability(const int level);
+
+	/** Like ContextTree::predictContext(), for the current context found by
+	 * OverlayContextTree::overlayContext(), which need not have copied or
+	 * created the nodes. */
+	weight_t predictContext(const symbol_t symbol) const;
+
+	/** The shared context tree. */
+	ContextTree const& m_base;
+
+	/** The nodes of the base in the current context (or NULL where the base
+	 * has no such node), corresponding to ContextTree::m_context. */
+	const CTNode **m_base_context;
+
+	/** The copies of the nodes of the base which have been updated. The
+	 * children of a copy are the nodes created in the overlay only. */
+	std::unordered_map<const CTNode*, CTNode*> m_copies;
+
+	/** The number of nodes created in the overlay only. */
+	size_t m_created;
+
+	/** The size of the history up to which the overlay has no updates: its
+	 * updates (if any) are all of later symbols. */
+	size_t m_clean_size;
+
+	/** The symbols removed from the history by OverlayContextTree::revert()
+	 * and OverlayContextTree::revertHistory() whose reverts have not been
+	 * applied yet, most recent first. */
+	symbol_list_t m_pending;
+
+	/** Whether each of OverlayContextTree::m_pending was removed by
+	 * OverlayContextTree::revert(), so its update must be reverted. */
+	symbol_list_t m_pending_update;
+};
+
+
+/** A node of a ::PersistentContextTree. The node may be shared between several
+ * versions of the tree, so it counts the references to it. */
+class PersistentCTNode : public CTNode {
+	friend class PersistentContextTree;
+
+	/** Initialise the node with a single reference. */
+	PersistentCTNode(void) : m_refs(1) {}
+
+	/** The number of parents and versions referring to the node. */
+	int m_refs;
+};
+
+
+/** A persistent context tree: the versions of its nodes are immutable and
+ * share the nodes they have in common. Updating or reverting the tree copies
+ * the nodes on the context path that are shared with another version
+ * (path-copying), and changes the nodes that are not shared in place. Without
+ * retained versions, the tree therefore behaves exactly like ::ContextTree.
+ *
+ * PersistentContextTree::retainVersion() returns the current version in
+ * constant time, and PersistentContextTree::restoreVersion() makes a version
+ * current again in constant time, without reverting any updates. A version
+ * consists of the nodes only: the history is kept consistent with
+ * ContextTree::updateHistory() and ContextTree::revertHistory(). Versions are
+ * reference counted and their nodes are freed once they are no longer
+ * referred to by the tree or a retained version. */
+class PersistentContextTree : public ContextTree {
+public:
+
+	/** Create a persistent context tree of specified maximum depth.
+	 *
+	 * \param depth The maximum depth of the context tree. */
+	PersistentContextTree(const int depth);
+
+
+	/** Destroy the current version of the tree. Retained versions are not
+	 * affected. */
+	~PersistentContextTree(void);
+
+
+	/** Clears the history and replaces the nodes by an empty version. */
+	void clear(void);
+
+
+	/** Like ContextTree::revert(), but nodes are released rather than
+	 * deleted. */
+	void revert(void);
+
+
+	/** Retain the current version of the nodes.
+	 * \return The version, which must be released with
+	 * PersistentContextTree::releaseVersion(). */
+	ct_version_t retainVersion(void);
+
+
+	/** Replace the nodes by a version retained earlier, without releasing
+	 * the version. The history is not changed.
+	 * \param version The version. */
+	void restoreVersion(ct_version_t version);
+
+
+	/** Release a version retained by PersistentContextTree::retainVersion(),
+	 * freeing the nodes no longer referred to.
+	 * \param version The version. */
+	static void releaseVersion(ct_version_t version);
+
+protected:
+
+	/** Like ContextTree::updateContext(), but nodes on the context path that
+	 * are shared with another version are replaced by copies. */
+	void updateContext(void);
+
+private:
+
+	/** Release a reference to a node, deleting it and releasing its children
+	 * if it was the last one.
+	 * \param node The node. */
+	static void release(CTNode *node);
+};
+
+
+/** A snapshot of another context tree, taken once the agent stops learning,
+ * compiled into a compact array. The nodes are stored in breadth-first
+ * order, so the upper levels of the tree, which every prediction visits, are
+ * contiguous in memory. Each node only holds its counts, its log KT estimate
+ * and log weighted probability, and the 32-bit indices of its children (see
+ * FrozenContextTree::frozen_node_t), so it is smaller than a ::CTNode.
+ *
+ * The search still simulates updates. They are applied to the array in
+ * place, and the nodes they create are appended to it. Each update saves the
+ * previous probabilities of the nodes of its context in an undo log, so
+ * FrozenContextTree::revert() restores them exactly and removes the nodes
+ * the update created, without looking any node up. Updates must be reverted
+ * in the reverse order, as the agent does after each simulation. */
+class FrozenContextTree : public ContextTree {
+public:
+
+	/** Compile a context tree, including its history.
+	 *
+	 * \param tree The context tree to compile. */
+	FrozenContextTree(ContextTree const& tree);
+
+
+	/** Copy a frozen tree, including its history.
+	 *
+	 * \param tree The frozen tree, which must have no updates to revert. */
+	FrozenContextTree(FrozenContextTree const& tree);
+
+
+	/** Clears the history and replaces the nodes by an empty root. */
+	void clear(void);
+
+
+	/** Like ContextTree::update(), saving the nodes of the context in the
+	 * undo log. */
+	void update(const symbol_t symbol);
+
+	/** Like ContextTree::update(symbol_list_t const&). */
+	using ContextTree::update;
+
+
+	/** Like ContextTree::revert(), restoring the nodes of the context from
+	 * the undo log. */
+	void revert(void);
+
+	/** Like ContextTree::revert(const int). */
+	using ContextTree::revert;
+
+
+	/** Like ContextTree::predict(const symbol_t). */
+	weight_t predict(const symbol_t symbol);
+
+	/** Like ContextTree::predict(symbol_list_t const&). */
+	using ContextTree::predict;
+
+
+	/** Like ContextTree::genRandomSymbolsAndUpdate(). */
+	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, const int bits);
+
+
+	/** Like ContextTree::logBlockProbability(). */
+	double logBlockProbability(void) const;
+
+
+	/** \return The number of nodes in the array. */
+	size_t size(void) const { return m_nodes.size(); }
+
+private:
+
+	/** A node of the array, with the same values as a ::CTNode. The index
+	 * of a missing child is 0, which is the root's. */
+	struct frozen_node_t {
+		weight_t log_kt;
+		weight_t log_probability;
+		uint32_t count[2];
+		uint32_t child[2];
+	};
+
+	/** The values of a node before an update, in the undo log. */
+	struct frozen_undo_t {
+		uint32_t node;
+		weight_t log_kt;
+		weight_t log_probability;
+	};
+
+	/** Fill FrozenContextTree::m_path with the nodes of the current
+	 * context, from the root.
+	 * \param create Whether to append missing nodes to the array.
+	 *     Otherwise the path ends before the first missing node.
+	 * \return The depth of the deepest node found. */
+	int findPath(const bool create);
+
+	/** Like ContextTree::predictContext(), along FrozenContextTree::m_path.
+	 * \param symbol The symbol.
+	 * \param found The depth of the deepest node of the path. */
+	weight_t predictPath(const symbol_t symbol, const int found) const;
+
+	/** Update the nodes of FrozenContextTree::m_path, found down to the
+	 * maximum depth, as CTNode::update() does, saving them in the undo log.
+	 * \param symbol The symbol.
+	 * \param size The number of nodes before the path was found. */
+	void learnPath(const symbol_t symbol, const size_t size);
+
+	/** Like CTNode::logKTMultiplier(). */
+	static weight_t logKTMultiplier(frozen_node_t const& node,
+	                                const symbol_t symbol);
+
+	/** The nodes, in breadth-first order from the root, followed by those
+	 * created by updates which have not been reverted. */
+	std::vector<frozen_node_t> m_nodes;
+
+	/** The indices of the nodes found by FrozenContextTree::findPath(). */
+	std::vector<uint32_t> m_path;
+
+	/** The nodes of the context of each update which has not been
+	 * reverted, from the root, before the update. */
+	std::vector<frozen_undo_t> m_undo;
+
+	/** The number of nodes before each update which has not been
+	 * reverted. */
+	std::vector<size_t> m_undo_size;
+};
+
+
+/** A context tree which computes the same probabilities as ::ContextTree
+ * without logarithms and exponentials in its nodes. Instead of the log
+ * probabilities, each node \f$ n \f$ above the maximum depth stores the ratio
+ * \f[
+ *     \beta_n = \frac{\Pr_\text{kt}(h_n)}{P_w^{n0} P_w^{n1}}
+ * \f]
+ * in CTNode::m_beta (the KT estimates are computed from the counts). The
+ * weighted conditional probability of a symbol \f$ x \f$ at a node then
+ * follows from that at its child \f$ c \f$ in the current context:
+ * \f[
+ *     P_w^n(x \,|\, h) = \frac{\beta_n \Pr_\text{kt}(x \,|\, h_n)
+ *                                + P_w^c(x \,|\, h)}{\beta_n + 1},
+ * \f]
+ * and observing \f$ x \f$ multiplies \f$ \beta_n \f$ by
+ * \f$ \Pr_\text{kt}(x \,|\, h_n) / P_w^c(x \,|\, h) \f$. Predictions and
+ * updates therefore only propagate a probability from the leaf to the root.
+ * The log block probability is kept at the tree, which takes one logarithm
+ * per update.
+ *
+ * The ratios are limited to a range in which one of the two estimates has no
+ * noticeable effect on the predictions, so they cannot overflow. A node which
+ * reaches the limit reverts to a slightly different ratio, so predictions
+ * agree with those of ::ContextTree up to rounding and the limit. */
+class RatioContextTree : public ContextTree {
+public:
+
+	/** Create a context tree of specified maximum depth.
+	 *
+	 * \param depth The maximum depth of the context tree. */
+	RatioContextTree(const int depth);
+
+
+	/** Clears the history and the nodes. */
+	void clear(void);
+
+
+	/** Like ContextTree::update(). */
+	void update(const symbol_t symbol);
+
+
+	/** Like ContextTree::revert(). */
+	void revert(void);
+
+
+	/** Like ContextTree::predict(const symbol_t). */
+	weight_t predict(const symbol_t symbol);
+
+
+	/** Like ContextTree::genRandomSymbolsAndUpdate(). */
+	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, const int bits);
+
+
+	/** Like ContextTree::logBlockProbability(). */
+	double logBlockProbability(void) const { return m_log_block_probability; }
+
+protected:
+
+	/** Like ContextTree::updateContext(), but new nodes also get the ratio
+	 * of an empty node. */
+	void updateContext(void);
+
+private:
+
+	/** The conditional probability of a symbol given the nodes of the
+	 * current context, found by ContextTree::updateContext() or
+	 * ContextTree::findContext(), of which missing nodes are treated as
+	 * empty nodes.
+	 * \param symbol The symbol to predict.
+	 * \return The conditional probability of the symbol. */
+	weight_t predictContext(const symbol_t symbol) const;
+
+	/** Update the nodes of the current context.
+	 * \param symbol The symbol observed.
+	 * \return The conditional probability of the symbol before the
+	 * update. */
+	weight_t updateNodes(const symbol_t symbol);
+
+	/** Revert the update of the nodes of the current context, deleting
+	 * nodes which are no longer visited.
+	 * \param symbol The symbol of the update.
+	 * \return The conditional probability of the symbol after the
+	 * revert. */
+	weight_t revertNodes(const symbol_t symbol);
+
+	/** The log block probability of the history, as at the root of a
+	 * ::ContextTree. */
+	weight_t m_log_block_probability;
+};
+
+
+/** A context tree whose top levels are stored in an array without separate
+ * allocations, in the implicit layout of a binary heap: the children of the
+ * node at index \f$ i \f$ are at \f$ 2i + 1 \f$ and \f$ 2i + 2 \f$, so
+ * the nodes of the current context in these levels are found by arithmetic on
+ * the context rather than by following the links between nodes. If the tree
+ * is deeper than the array, the nodes of the bottom level of the array are the
+ * roots of subtrees of separately allocated nodes, as in ::ContextTree.
+ *
+ * The nodes of the array are created with the tree and never deleted. They are
+ * still linked to their children, so that they are updated like the other
+ * nodes and can be read by the subclasses of ::ContextTree which copy or share
+ * a tree. */
+class DenseContextTree : public ContextTree {
+public:
+
+	/** Create a context tree of specified maximum depth.
+	 *
+	 * \param depth The maximum depth of the context tree.
+	 * \param dense_depth The depth of the deepest level stored in the array,
+	 *     at most the depth of the tree. */
+	DenseContextTree(const int depth, const int dense_depth);
+
+
+	/** Destroy the array and the nodes below it. */
+	~DenseContextTree(void);
+
+
+	/** Clears the history and replaces the nodes by empty ones. */
+	void clear(void);
+
+
+	/** Like ContextTree::revert(), but the nodes in the array are never
+	 * deleted. */
+	void revert(void);
+
+
+	/** \return The number of nodes in use, as for ContextTree::size():
+	 * the root and the visited nodes of the array, and the nodes below
+	 * it. */
+	size_t size(void) const;
+
+
+	/** The depth of the deepest level of a context tree that can be stored
+	 * in an array of a given size.
+	 * \param depth The maximum depth of the context tree.
+	 * \param memory The size of the array in bytes.
+	 * \return The depth of the deepest level, at most depth, or -1 if not
+	 * even the root fits. */
+	static int denseDepth(const int depth, const size_t memory);
+
+protected:
+
+	/** Like ContextTree::updateContext(), but nodes in the array are found by
+	 * their indices. */
+	void updateContext(void);
+
+	/** Like ContextTree::findContext(), but nodes in the array are found by
+	 * their indices. */
+	void findContext(void);
+
+private:
+
+	/** Replace the array by an array of empty nodes, linked to their
+	 * children in the array. */
+	void allocate(void);
+
+	/** Delete the array and the nodes below it. */
+	void deallocate(void);
+
+	/** Find the nodes of the current context in the array.
+	 * \return The node at the bottom level of the array. */
+	CTNode *denseContext(void);
+
+	/** The nodes of levels 0 to DenseContextTree::m_dense_depth, in
+	 * breadth-first order from the root. */
+	CTNode *m_nodes;
+
+	/** The depth of the deepest level stored in DenseContextTree::m_nodes. */
+	int m_dense_depth;
+};
+
+
+/** A node of a ::SymbolContextTree. Like ::CTNode, but the node predicts
+ * symbols of several bits with a multi-alphabet KT estimator, and has a child
+ * for each value of the symbol of the context at its level which has
+ * occurred. The counts and children are stored sparsely, since only a few of
+ * the values of a symbol usually occur in a context. */
+class SymbolCTNode {
+	friend class SymbolContextTree;
+
+	/** The ::FactoredContextTree class learns several symbols at the same
+	 * time in the same way as the ::ContextTree class. */
+	friend class FactoredContextTree;
+
+	/** Initialise the node. */
+	SymbolCTNode(void);
+
+	/** Destroy the node and all children. */
+	~SymbolCTNode(void);
+
+	/** The number of nodes in the tree rooted at this node. */
+	int size(void) const;
+
+	/** The number of times a symbol has been observed in this context.
+	 * \param symbol The symbol. */
+	int count(const interaction_t symbol) const;
+
+	/** Add to the number of times a symbol has been observed in this
+	 * context.
+	 * \param symbol The symbol.
+	 * \param delta The number to add, 1 or -1. */
+	void addCount(const interaction_t symbol, const int delta);
+
+	/** The KT estimate of the probability of observing a symbol,
+	 * \f$ (c_x + 1/2) / (n + M/2) \f$ for a symbol \f$ x \f$ observed
+	 * \f$ c_x \f$ of \f$ n \f$ times and an alphabet of \f$ M \f$
+	 * symbols.
+	 * \param symbol The symbol.
+	 * \param alphabet The number of symbols in the alphabet. */
+	weight_t ktMultiplier(const interaction_t symbol, const int alphabet) const;
+
+	/** The child for a value of the symbol of the context at the level of
+	 * this node, or NULL if it does not exist.
+	 * \param symbol The value. */
+	SymbolCTNode *child(const interaction_t symbol) const;
+
+	/** The log KT estimate of the symbols observed in this context. */
+	weight_t m_log_kt;
+
+	/** The log weighted probability of the symbols observed in this
+	 * context. */
+	weight_t m_log_probability;
+
+	/** The sum of the log weighted probabilities of the children. */
+	weight_t m_log_children;
+
+	/** The number of symbols observed in this context. */
+	int m_visits;
+
+	/** The number of times each symbol which has occurred has been
+	 * observed. */
+	std::vector<std::pair<interaction_t, int> > m_counts;
+
+	/** The children, by the value of the symbol of the context. */
+	std::vector<std::pair<interaction_t, SymbolCTNode*> > m_children;
+};
+
+
+/** A context tree which predicts whole symbols of several bits (such as the
+ * reward, the observation or the action, or parts of them) rather than single
+ * bits, so that learning or sampling a symbol takes a single walk from the
+ * leaf to the root instead of one walk per bit.
+ *
+ * Every interaction cycle is divided into the same sequence of symbols: the
+ * fields of the cycle (as given to the constructor) are divided into symbols
+ * of at most a given number of bits. Each symbol position of the cycle has
+ * its own tree, whose context is formed by the preceding symbols, as many as
+ * cover the depth of the context tree in bits. The probability of the history
+ * is the product of the weighted probabilities of the roots of the trees.
+ *
+ * The tree presents the same interface as ::ContextTree, over the history of
+ * bits. A symbol is learnt when its last bit is added by ContextTree::update(),
+ * and unlearnt when that bit is reverted by ContextTree::revert(). Until then
+ * its bits only extend the history, and predictions of single bits are the
+ * marginals of the distribution of the symbol given the bits of it seen so
+ * far. The history must start at the beginning of a cycle, and lists of
+ * symbols predicted by ContextTree::predict(symbol_list_t const&) must consist
+ * of whole symbols.
+ *
+ * The binary nodes of ::ContextTree are not used: every member which walks
+ * them is overridden, and the nodes of the trees are found by
+ * SymbolContextTree::findPath() instead. */
+class SymbolContextTree : public ContextTree {
+public:
+
+	/** Create a context tree of specified maximum depth.
+	 *
+	 * \param depth The maximum depth of the context tree in bits.
+	 * \param symbol_bits The maximum number of bits of a symbol.
+	 * \param fields The numbers of bits of the fields of an interaction
+	 *     cycle, in the order in which they occur in the history. */
+	SymbolContextTree(const int depth, const int symbol_bits,
+	                  std::vector<int> const& fields);
+
+
+	/** Destroy the trees. */
+	~SymbolContextTree(void);
+
+
+	/** Clears the history and the trees. */
+	void clear(void);
+
+
+	/** Like ContextTree::update(), learning the symbol that the bit
+	 * completes (if any). */
+	void update(const symbol_t symbol);
+
+
+	/** Like ContextTree::updateHistory(). */
+	void updateHistory(const symbol_t symbol);
+
+
+	/** Like ContextTree::revert(), unlearning the symbol that the bit
+	 * completed (if any). */
+	void revert(void);
+
+
+	/** Like ContextTree::revertHistory(). */
+	void revertHistory(const int num_symbols);
+
+
+	/** Like ContextTree::predict(const symbol_t). */
+	weight_t predict(const symbol_t symbol);
+
+
+	/** Like ContextTree::genRandomSymbolsAndUpdate(). Whole symbols are
+	 * sampled at once. */
+	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, const int bits);
+
+
+	/** Like ContextTree::logBlockProbability(). */
+	double logBlockProbability(void) const;
+
+
+	/** \return The number of nodes in the trees. */
+	size_t size(void) const;
+
+private:
+
+	/** The symbol position of the cycle at which a bit of the history falls.
+	 * \param index The position of the bit in the history (which may be
+	 *     the size of the history, for the next bit).
+	 * \param start Receives the position in the history of the first bit of
+	 *     the symbol.
+	 * \return The symbol position. */
+	int position(const size_t index, size_t &start) const;
+
+	/** The value of the symbol at a position of the history.
+	 * \param start The position of the first bit of the symbol.
+	 * \param bits The number of bits of the symbol. */
+	interaction_t value(const size_t start, const int bits) const;
+
+	/** Fill SymbolContextTree::m_path with the nodes of the context of a
+	 * symbol, from the root of its tree.
+	 * \param position The symbol position of the cycle.
+	 * \param start The position in the history of the first bit of the
+	 *     symbol.
+	 * \param create Whether to create missing nodes. Otherwise missing
+	 *     nodes are set to NULL.
+	 * \return False if the history is too short to provide the context. */
+	bool findPath(const int position, const size_t start, const bool create);
+
+	/** Learn or unlearn the symbol at a position of the history.
+	 * \param position The symbol position of the cycle.
+	 * \param start The position in the history of the first bit of the
+	 *     symbol, whose bits must all be in the history.
+	 * \param learn Whether to learn or to unlearn the symbol. */
+	void updateSymbol(const int position, const size_t start, const bool learn);
+
+	/** Compute the distribution of the symbol at a position of the history
+	 * into SymbolContextTree::m_distribution, unless it is already there.
+	 * \param position The symbol position of the cycle.
+	 * \param start The position in the history of the first bit of the
+	 *     symbol.
+	 * \return False if the history is too short to provide the context. */
+	bool distribution(const int position, const size_t start);
+
+	/** The number of bits of an interaction cycle. */
+	int m_cycle_bits;
+
+	/** The number of bits of each symbol position of the cycle. */
+	std::vector<int> m_symbol_bits;
+
+	/** The offset in the cycle of the first bit of each symbol position. */
+	std::vector<int> m_symbol_offset;
+
+	/** The number of symbols in the context of each symbol position. */
+	std::vector<int> m_symbol_depth;
+
+	/** The number of bits of the context of each symbol position. */
+	std::vector<int> m_context_bits;
+
+	/** The symbol position of each bit of the cycle. */
+	std::vector<int> m_bit_position;
+
+	/** The root of the tree of each symbol position. */
+	std::vector<SymbolCTNode*> m_roots;
+
+	/** The nodes found by SymbolContextTree::findPath(). */
+	std::vector<SymbolCTNode*> m_path;
+
+	/** Whether each bit of the history was added by
+	 * SymbolContextTree::update(). */
+	symbol_list_t m_learnt;
+
+	/** The distribution computed by SymbolContextTree::distribution(). */
+	std::vector<weight_t> m_distribution;
+
+	/** The position in the history of the symbol whose distribution is in
+	 * SymbolContextTree::m_distribution, or -1 if there is none. Reset
+	 * whenever the trees change or the history shrinks below it. */
+	long long m_distribution_start;
+};
+
+
+/** A factored context tree, which has a separate binary context tree for each
+ * bit position of an interaction cycle, as described for factored CTW in the
+ * MC-AIXI-CTW paper. Each bit is predicted and learnt by the tree of its
+ * position, from the same context of preceding bits as in ::ContextTree, so
+ * each tree only holds the statistics of its own bit and stays smaller. The
+ * probability of the history is the product of the weighted probabilities of
+ * the roots of the trees.
+ *
+ * The trees share the history and the code of ::ContextTree, which works on
+ * the tree of the next bit (or the most recent one, for reverts) through
+ * ContextTree::m_root. Since the bits of a known percept are learnt by
+ * different trees, they can be learnt in parallel
+ * (FactoredContextTree::updateInParallel()). The history must start at the
+ * beginning of a cycle. */
+class FactoredContextTree : public ContextTree {
+public:
+
+	/** Create a factored context tree of specified maximum depth.
+	 *
+	 * \param depth The maximum depth of each context tree.
+	 * \param cycle_bits The number of bits of an interaction cycle.
+	 * \param threads The maximum number of threads used by
+	 *     FactoredContextTree::updateInParallel(). */
+	FactoredContextTree(const int depth, const int cycle_bits,
+	                    const int threads);
+
+
+	/** Destroy the trees. */
+	~FactoredContextTree(void);
+
+
+	/** Clears the history and the trees. */
+	void clear(void);
+
+
+	/** Like ContextTree::update(), with the tree of the bit. */
+	void update(const symbol_t symbol);
+
+
+	/** Update the trees with a list of symbols as ContextTree::update()
+	 * does, learning the symbols in parallel in their trees.
+	 * \param symbols The symbols. */
+	void updateInParallel(symbol_list_t const& symbols);
+
+
+	/** Like ContextTree::revert(), with the tree of the bit. */
+	void revert(void);
+
+
+	/** Like ContextTree::predict(const symbol_t), with the tree of the
+	 * bit. */
+	weight_t predict(const symbol_t symbol);
+
+
+	/** Like ContextTree::genRandomSymbolsAndUpdate(), with the tree of
+	 * each bit. */
+	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, const int bits);
+
+
+	/** Like ContextTree::logBlockProbability(). */
+	double logBlockProbability(void) const;
+
+
+	/** \return The number of nodes in the trees. */
+	size_t size(void) const;
+
+private:
+
+	/** Make the tree of the bit at a position of the history the current
+	 * one, in ContextTree::m_root.
+	 * \param index The position of the bit in the history. */
+	void selectTree(const size_t index);
+
+	/** Learn a bit of the history in its tree, like ContextTree::update()
+	 * but with a given array for the nodes of the context, so that several
+	 * bits can be learnt at the same time.
+	 * \param index The position of the bit in the history.
+	 * \param context An array of ContextTree::m_depth + 1 nodes.
+	 * \return The number of nodes created. */
+	size_t learn(const size_t index, CTNode **context);
+
+	/** The root of the tree of each bit position of the cycle. */
+	std::vector<CTNode*> m_roots;
+
+	/** The maximum number of threads used by
+	 * FactoredContextTree::updateInParallel(). */
+	int m_threads;
+
+	/** The threads of FactoredContextTree::updateInParallel(), created once,
+	 * or NULL for a single thread. */
+	WorkerPool *m_pool;
+
+	/** The nodes of the context of the bit each thread learns. */
+	std::vector<std::vector<CTNode*> > m_contexts;
+};
+
+
+/** A context tree whose nodes are shared between several instances, each
+ * with its own history, so that agents in different threads can learn a
+ * single model from their own interactions at the same time. The first
+ * instance owns the nodes, and the others are created from it.
+ *
+ * SharedContextTree::update() walks down the tree holding the lock of one
+ * node at a time, creating missing children, and then updates the nodes from
+ * the leaf to the root as ContextTree::update() does. The locks are striped
+ * (SharedContextTree::m_locks): each lock guards the nodes whose addresses
+ * hash to it. A node is updated while holding its own lock and those of its
+ * children, taken in the order of their addresses, so its weighted
+ * probability is computed from consistent values.
+ * The last update of a node then sees the final probabilities of its
+ * children, so the tree is consistent once all updates have finished.
+ * However, the order in which the updates reach a node changes the rounding
+ * of its KT estimate, so concurrent updates are not exactly reproducible.
+ *
+ * SharedContextTree::revert() undoes an update of the same instance in the
+ * same way, but keeps the nodes which are no longer visited.
+ *
+ * Only updates, reverts and the histories may change the tree. It must
+ * not be read in any other way, e.g. through an ::OverlayContextTree, while
+ * any instance is being updated. */
+class SharedContextTree : public ContextTree {
+public:
+
+	/** Create a shared context tree of specified maximum depth, which owns
+	 * its nodes.
+	 *
+	 * \param depth The maximum depth of the context tree. */
+	SharedContextTree(const int depth);
+
+
+	/** Create a context tree with an empty history which shares the nodes of
+	 * another.
+	 *
+	 * \param owner The context tree that owns the nodes. It must outlive
+	 *     this one. */
+	SharedContextTree(SharedContextTree const& owner);
+
+
+	/** Destroy the context tree, and the nodes if it owns them. */
+	~SharedContextTree(void);
+
+
+	/** Clears the history. The shared nodes are kept. */
+	void clear(void);
+
+
+	/** Like ContextTree::update(), but safe to call on several instances
+	 * sharing nodes at the same time. */
+	void update(const symbol_t symbol);
+
+	/** Like ContextTree::update(symbol_list_t const&). */
+	using ContextTree::update;
+
+
+	/** Like ContextTree::revert(), but safe to call on several instances
+	 * sharing nodes at the same time. Nodes which are no longer visited are
+	 * kept, as other instances may be using them. */
+	void revert(void);
+
+	/** Like ContextTree::revert(const int). */
+	using ContextTree::revert;
+
+private:
+
+	/** The lock of a node.
+	 * \param node The node. */
+	std::mutex &lock(const CTNode *node) const;
+
+	/** Update a node with a symbol, as CTNode::update() does, or revert it,
+	 * holding the locks of the node and of its children.
+	 * \param node The node.
+	 * \param symbol The symbol.
+	 * \param undo Whether to revert rather than update. */
+	void learn(CTNode *node, const symbol_t symbol, const bool undo = false);
+
+	/** Whether this instance owns the nodes and the locks. */
+	bool m_owner;
+
+	/** The locks guarding the nodes, shared by all instances. */
+	std::vector<std::mutex> *m_locks;
 };
 
 #endif // __PREDICT_HPP__
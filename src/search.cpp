@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <limits>
+#include <unordered_set>
 #include "agent.hpp"
 #include "search.hpp"
 #include "util.hpp"
@@ -12,45 +14,138 @@ SearchNode::SearchNode(const nodetype_t nodetype) {
 	m_mean = 0;
 	m_visits = 0;
 	m_type = nodetype;
+	m_parents = 0;
+	m_actions = NULL;
+	m_percept_cache = nodetype == chance ? new PerceptCache() : NULL;
 }
 
 SearchNode::~SearchNode(void) {
 	child_map_t::iterator child_iter = m_child.begin();
 	for( ; child_iter != m_child.end(); child_iter++) {
-		delete child_iter->second;
+		release(child_iter->second);
 	}
+	delete m_actions;
+	delete m_percept_cache;
+}
+
+
+void SearchNode::release(SearchNode *node) {
+	if (--node->m_parents == 0)
+		delete node;
+}
+
+
+size_t SearchNode::size(void) const {
+	std::unordered_set<SearchNode const*> shared;
+	return size(shared);
+}
+
+
+// Only nodes with several parents can be reached twice, so only they need to
+// be remembered
+size_t SearchNode::size(std::unordered_set<SearchNode const*> &shared) const {
+	size_t nodes = 1;
+	child_map_t::const_iterator c = m_child.begin();
+	for ( ; c != m_child.end(); c++) {
+		SearchNode const *node = c->second;
+		if (node->m_parents > 1 && !shared.insert(node).second)
+			continue;
+		nodes += node->size(shared);
+	}
+	return nodes;
+}
+
+
+void SearchNode::clearPerceptCaches(void) {
+	if (m_percept_cache != NULL)
+		m_percept_cache->clear();
+	child_map_t::iterator c = m_child.begin();
+	for ( ; c != m_child.end(); c++)
+		c->second->clearPerceptCaches();
 }
 
 // Select an action according to UCB policy
 action_t SearchNode::selectAction(Agent const& agent) {
+	return action(selectActionIndex(agent));
+}
+
+
+// Select the position of an action in action_stats_t::order according to the
+// UCB policy. The priorities are computed in a separate loop over the flat
+// per-action statistics, which the compiler can vectorize.
+int SearchNode::selectActionIndex(Agent const& agent) {
 	const double explore_bias = agent.horizon() * agent.maxReward();
 	const double unexplored_bias = 1000000000.0;
 	const double log_visits = std::log((double) visits());
 
-	// Compute the best action according to the UCB formula.
-	action_t best_action;
-	double best_priority = -std::numeric_limits<double>::infinity();
-	for (action_t a = 0; a <= agent.maxAction(); a++) {
-		SearchNode *n = child(a);
-
-		// Use UCB formula to determine priority of node
-		double priority = 0.0;
-		if (n == NULL || n->visits() == 0) { // Previously unexplored node
-			priority = unexplored_bias;
-		} else {                             // Previously explored node
-			double nvisits = double(n->visits());
-			priority = n->expectation() + explore_bias
-				* std::sqrt(exploration_constant * log_visits / nvisits);
+	// Set up the per-action statistics on the first selection. With action
+	// widening, actions are considered in a random order.
+	const int actions = agent.maxAction() + 1;
+	if (m_actions == NULL) {
+		m_actions = new action_stats_t();
+		m_actions->visits.assign(actions, 0);
+		m_actions->mean.assign(actions, 0.0);
+		if (agent.actionsConsidered(0) < actions) {
+			std::vector<action_t> &order = m_actions->order;
+			order.resize(actions);
+			for (int i = 0; i < actions; i++) {
+				const int j = randRange(i + 1);
+				order[i] = order[j];
+				order[j] = i;
+			}
 		}
+	}
+	const int considered = std::min(actions, agent.actionsConsidered(visits()));
+	const double *action_visits = &m_actions->visits[0];
+	const double *action_mean = &m_actions->mean[0];
 
-		// Update best action if necessary, breaking ties randomly.
-		if (priority > best_priority + rand01() * 0.001) {
-			best_action = a;
-			best_priority = priority;
+	// With transpositions, a child pools the statistics of every path to it,
+	// which are used instead of those of the action if the child exists.
+	static thread_local std::vector<double> pooled_visits, pooled_mean;
+	if (agent.sharesSearchNodes()) {
+		pooled_visits.assign(action_visits, action_visits + considered);
+		pooled_mean.assign(action_mean, action_mean + considered);
+		for (int i = 0; i < considered; i++) {
+			SearchNode const *n = child(action(i));
+			if (n != NULL && n->visits() > 0) {
+				pooled_visits[i] = double(n->visits());
+				pooled_mean[i] = n->expectation();
+			}
 		}
+		action_visits = &pooled_visits[0];
+		action_mean = &pooled_mean[0];
+	}
+
+	// Compute the priority of each action according to the UCB formula.
+	static thread_local std::vector<double> priorities;
+	priorities.resize(considered);
+	double *priority = &priorities[0];
+	for (int i = 0; i < considered; i++) {
+		const double nvisits = action_visits[i];
+		const double ucb = action_mean[i] + explore_bias
+			* std::sqrt(exploration_constant * log_visits / nvisits);
+		priority[i] = nvisits == 0.0 ? unexplored_bias : ucb;
 	}
 
-	return best_action;
+	// Compute the best action, breaking ties among the actions with the best
+	// priority with a single random draw.
+	double best_priority = -std::numeric_limits<double>::infinity();
+	int ties = 0;
+	for (int i = 0; i < considered; i++) {
+		if (priority[i] > best_priority) {
+			best_priority = priority[i];
+			ties = 1;
+		} else if (priority[i] == best_priority) {
+			ties++;
+		}
+	}
+
+	int tie = ties > 1 ? randRange(ties) : 0;
+	for (int i = 0; i < considered; i++) {
+		if (priority[i] == best_priority && tie-- == 0)
+			return i;
+	}
+	return 0;
 }
 
 
@@ -61,33 +156,51 @@ reward_t SearchNode::sample(Agent &agent, const int horizon) {
 	// return the reward. Otherwise continuing sampling or use a playout policy
 	// as appropriate.
 	if (horizon == 0) {
-		return 0.0; // Reached agent horizon
+		reward = 0.0; // Reached agent horizon
 	}
 	else if (m_type == chance) {
 		// We are at a chance node, generate a percept at random using the
-		// agents environment model and continue sampling.
+		// agents environment model and continue sampling. With progressive
+		// widening, a percept is only generated if the node may have another
+		// child. Otherwise one of the percepts generated before is chosen in
+		// proportion to how often it was visited.
 		percept_t o, r;
-		agent.genPerceptAndUpdate(o, r);
+		interaction_t i;
+		if (agent.admitPercept(m_child.size(), visits()))
+			i = agent.simulatePercept(*m_percept_cache, o, r);
+		else
+			agent.simulateKnownPercept(*m_percept_cache, i = selectPercept(),
+			                           o, r);
 
-		if (!child(o))
-			m_child[o] = new SearchNode(decision);
-		reward = r + m_child[o]->sample(agent, horizon - 1);
+		// Fall back to the playout policy once the node budget is exhausted
+		if (child(i) == NULL && !agent.canExpand())
+			reward = r + agent.simulatePlayout(horizon - 1);
+		else
+			reward = r + findChild(agent, i, horizon - 1)->sample(agent, horizon - 1);
 	}
 	else if (visits() == 0) {
 		// We are at a decision node. Either the node is previously unvisited or
 		// we have exceeded the maximum tree depth. Either way, use the playout
 		// policy to estimate the future reward.
-		reward = agent.playout(horizon);
+		reward = agent.simulatePlayout(horizon);
 	}
 	else {
 		// We are at a decision node, choose an action according to the UCB
-		// policy and continue sampling.
-		action_t a = selectAction(agent);
-		agent.modelUpdate(a);
+		// policy and continue sampling. Once the node budget is exhausted, an
+		// action without a node is replaced by the playout policy.
+		const int i = selectActionIndex(agent);
+		const action_t a = action(i);
+		if (child(a) == NULL && !agent.canExpand()) {
+			reward = agent.simulatePlayout(horizon);
+		} else {
+			agent.simulateAction(a);
+			reward = findChild(agent, a, horizon)->sample(agent, horizon);
+		}
 
-		if (child(a) == NULL)
-			m_child[a] = new SearchNode(chance);
-		reward = m_child[a]->sample(agent, horizon);
+		// Update the statistics of the action (as for the child node)
+		double v = m_actions->visits[i];
+		m_actions->mean[i] = (reward + v * m_actions->mean[i]) / (v + 1.0);
+		m_actions->visits[i]++;
 	}
 
 	// Update the expected reward and number of visits to the current node.
@@ -98,9 +211,204 @@ reward_t SearchNode::sample(Agent &agent, const int horizon) {
 }
 
 
+// Choose a child of a chance node in proportion to its visits
+interaction_t SearchNode::selectPercept(void) const {
+	assert(m_type == chance && !m_child.empty());
+
+	visits_t total = 0;
+	child_map_t::const_iterator c = m_child.begin();
+	for ( ; c != m_child.end(); c++)
+		total += c->second->visits();
+
+	double target = rand01() * double(total);
+	for (c = m_child.begin(); c != m_child.end(); c++) {
+		target -= double(c->second->visits());
+		if (target < 0.0)
+			return c->first;
+	}
+	return m_child.rbegin()->first;
+}
+
+
 SearchNode *SearchNode::child(const interaction_t child_index) const {
 	child_map_t::const_iterator c = m_child.find(child_index);
 	return c == m_child.end() ? NULL : c->second;
 }
 
 
+SearchNode *SearchNode::findChild(Agent &agent,
+		const interaction_t child_index, const int horizon) {
+	SearchNode *&c = m_child[child_index];
+	if (c == NULL) {
+		c = agent.newSearchNode(m_type == decision ? chance : decision,
+		                        horizon);
+		c->retain();
+	}
+	return c;
+}
+
+
+void search_stats_t::add(search_stats_t const& other) {
+	const int total = simulations + other.simulations;
+	if (total > 0) {
+		depth_mean = (depth_mean * simulations
+			+ other.depth_mean * other.simulations) / total;
+	}
+	depth_max = std::max(depth_max, other.depth_max);
+
+	simulations = total;
+	simulations_saved += other.simulations_saved;
+	nodes += other.nodes;
+	nodes_created += other.nodes_created;
+	playout_steps += other.playout_steps;
+	ct_nodes_created += other.ct_nodes_created;
+	ct_nodes_freed += other.ct_nodes_freed;
+	time_selection += other.time_selection;
+	time_sampling += other.time_sampling;
+	time_playout += other.time_playout;
+	time_revert += other.time_revert;
+	transposition_lookups += other.transposition_lookups;
+	transposition_hits += other.transposition_hits;
+}
+
+
+TranspositionTable::TranspositionTable(size_t size) {
+	size = std::max(cBucketSize, size - size % cBucketSize);
+	m_entries.resize(size);
+	clear();
+}
+
+
+// Find a node by looking through the key's bucket
+SearchNode *TranspositionTable::find(context_hash_t key) {
+	m_lookups++;
+	const size_t bucket = key % (m_entries.size() / cBucketSize);
+	for (size_t i = 0; i < cBucketSize; i++) {
+		entry_t const& e = m_entries[bucket * cBucketSize + i];
+		if (e.node != NULL && e.key == key) {
+			m_hits++;
+			return e.node;
+		}
+	}
+	return NULL;
+}
+
+
+// Store a node in an empty or the least visited entry of the key's bucket
+void TranspositionTable::insert(context_hash_t key, SearchNode *node) {
+	const size_t bucket = key % (m_entries.size() / cBucketSize);
+	entry_t *replace = &m_entries[bucket * cBucketSize];
+	for (size_t i = 0; i < cBucketSize; i++) {
+		entry_t *e = &m_entries[bucket * cBucketSize + i];
+		if (e->node == NULL) {
+			replace = e;
+			break;
+		}
+		if (e->node->visits() < replace->node->visits())
+			replace = e;
+	}
+	replace->key = key;
+	replace->node = node;
+}
+
+
+void TranspositionTable::clear(void) {
+	entry_t empty = {0, NULL};
+	std::fill(m_entries.begin(), m_entries.end(), empty);
+	m_lookups = 0;
+	m_hits = 0;
+}
+
+
+
+
+// Look up a cached percept bit prediction
+bool PerceptCache::find(unsigned int prefix, double &probability) const {
+	std::map<unsigned int, double>::const_iterator it =
+		m_bit_probability.find(prefix);
+	if (it == m_bit_probability.end())
+		return false;
+	probability = it->second;
+	return true;
+}
+
+
+// Cache a percept bit prediction
+void PerceptCache::store(unsigned int prefix, double probability) {
+	m_bit_probability[prefix] = probability;
+}
+
+
+PerceptCache::~PerceptCache(void) {
+	if (m_model_version)
+		PersistentContextTree::releaseVersion(m_model_version);
+}
+
+
+void PerceptCache::clear(void) {
+	m_bit_probability.clear();
+	m_alias_percept.clear();
+	m_alias_other.clear();
+	m_alias_threshold.clear();
+	setModelVersion(NULL);
+}
+
+
+// Replace the stored version of the model
+void PerceptCache::setModelVersion(ct_version_t version) {
+	if (m_model_version)
+		PersistentContextTree::releaseVersion(m_model_version);
+	m_model_version = version;
+}
+
+
+// Build an alias table (Vose's method) from the percept distribution.
+void PerceptCache::setDistribution(std::vector<interaction_t> const& percepts,
+		std::vector<double> const& probabilities) {
+	assert(percepts.size() == probabilities.size() && !percepts.empty());
+	const size_t n = percepts.size();
+
+	double total = 0.0;
+	for (size_t i = 0; i < n; i++)
+		total += probabilities[i];
+
+	// Scale the probabilities so that the average column has weight 1, and
+	// split the columns into those below and above average.
+	std::vector<double> weight(n);
+	std::vector<size_t> small, large;
+	for (size_t i = 0; i < n; i++) {
+		weight[i] = probabilities[i] * double(n) / total;
+		if (weight[i] < 1.0)
+			small.push_back(i);
+		else
+			large.push_back(i);
+	}
+
+	// Fill up each below average column with an above average one.
+	m_alias_percept = percepts;
+	m_alias_other = percepts;
+	m_alias_threshold.assign(n, 1.0);
+	while (!small.empty() && !large.empty()) {
+		size_t s = small.back(), l = large.back();
+		small.pop_back();
+
+		m_alias_threshold[s] = weight[s];
+		m_alias_other[s] = percepts[l];
+		weight[l] -= 1.0 - weight[s];
+		if (weight[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	m_bit_probability.clear();
+}
+
+
+// Sample a percept from the alias table
+interaction_t PerceptCache::sample(void) const {
+	assert(complete());
+	size_t column = randRange(m_alias_percept.size());
+	return rand01() < m_alias_threshold[column] ?
+		m_alias_percept[column] : m_alias_other[column];
+}
@@ -1,6 +1,8 @@
 #ifndef __SEARCH_HPP__
 #define __SEARCH_HPP__
+#include <unordered_set>
 #include "main.hpp"
+#include "predict.hpp"
 
 class Agent;
 
@@ -19,6 +21,240 @@ enum nodetype_t { chance, decision };
  * percepts as appropriate. */
 typedef std::map<interaction_t, SearchNode*> child_map_t;
 
+/** Stores the distribution of percepts at a chance node of the search tree.
+ * The agent's model is in the same state on every visit to a chance node, so
+ * the percept distribution need only be computed once. It is stored in one of
+ * two ways:
+ *  - Lazily, as the predicted probability that the next percept bit is a 1
+ *    given the preceding bits of the percept (PerceptCache::find(),
+ *    PerceptCache::store()). Predictions are added as the percepts are
+ *    sampled.
+ *  - Completely, as an alias table over all percepts
+ *    (PerceptCache::setDistribution(), PerceptCache::sample()). Percepts are
+ *    then sampled in constant time. Computing the whole distribution is
+ *    exponential in the number of percept bits, so is only worthwhile for
+ *    frequently visited chance nodes.
+ *
+ * If the model is a ::PersistentContextTree, the cache can also hold the
+ * version of the model at the chance node (PerceptCache::modelVersion()). */
+class PerceptCache {
+public:
+
+	/** Create an empty cache. */
+	PerceptCache(void) : m_model_version(NULL) {}
+
+	/** Release the stored version of the model, if any. */
+	~PerceptCache(void);
+
+	/** Look up the probability that the next percept bit is a 1.
+	 * \param prefix The preceding bits of the percept, preceded by a 1 bit.
+	 * \param probability Receives the probability, if known.
+	 * \return True if the probability is known. */
+	bool find(unsigned int prefix, double &probability) const;
+
+	/** Store the probability that the next percept bit is a 1.
+	 * \param prefix The preceding bits of the percept, preceded by a 1 bit.
+	 * \param probability The probability. */
+	void store(unsigned int prefix, double probability);
+
+	/** Forget the percept distribution and the version of the model, e.g.
+	 * after the model has changed. */
+	void clear(void);
+
+	/** \return The version of the model at the chance node, or NULL if
+	 * none is stored. */
+	ct_version_t modelVersion(void) const { return m_model_version; }
+
+	/** Store the version of the model at the chance node. The cache takes
+	 * over the reference to the version.
+	 * \param version A version retained with
+	 *     PersistentContextTree::retainVersion(), or NULL. */
+	void setModelVersion(ct_version_t version);
+
+	/** \return The number of lazily computed percept bit predictions. */
+	size_t predictions(void) const { return m_bit_probability.size(); }
+
+	/** \return True if the whole percept distribution is known. */
+	bool complete(void) const { return !m_alias_percept.empty(); }
+
+	/** Build an alias table from the whole percept distribution.
+	 * \param percepts The possible percepts (see Agent::perceptCode()).
+	 * \param probabilities The probability of each percept. */
+	void setDistribution(std::vector<interaction_t> const& percepts,
+	                     std::vector<double> const& probabilities);
+
+	/** Sample a percept from the alias table. Requires
+	 * PerceptCache::complete().
+	 * \return The sampled percept (see Agent::perceptCode()). */
+	interaction_t sample(void) const;
+
+private:
+	/** The lazily computed percept bit predictions, indexed by prefix. */
+	std::map<unsigned int, double> m_bit_probability;
+
+	/** The percept in each column of the alias table. */
+	std::vector<interaction_t> m_alias_percept;
+
+	/** The percept each column of the alias table refers to otherwise. */
+	std::vector<interaction_t> m_alias_other;
+
+	/** The probability of choosing the column's own percept. */
+	std::vector<double> m_alias_threshold;
+
+	/** The version of the model at the chance node, or NULL. */
+	ct_version_t m_model_version;
+};
+
+
+/** Statistics describing a single search for an action (Agent::search()). */
+struct search_stats_t {
+	/** The number of simulations conducted. */
+	int simulations;
+
+	/** The number of simulations left unused in the budget because the
+	 * search stopped early. */
+	int simulations_saved;
+
+	/** The number of nodes in the search tree at the end of the search. */
+	int nodes;
+
+	/** The number of simulations performed in the background while the
+	 * environment computed the next percept (see Agent::ponder()). */
+	int simulations_pondered;
+
+	/** The following are only collected if the metrics-log option is set. */
+
+	/** The average number of actions taken within the search tree by each
+	 * simulation. */
+	double depth_mean;
+
+	/** The maximum number of actions taken within the search tree by a
+	 * simulation. */
+	int depth_max;
+
+	/** The number of search nodes created. */
+	int nodes_created;
+
+	/** The number of cycles simulated by playouts. */
+	long long playout_steps;
+
+	/** The number of context tree nodes created. */
+	long long ct_nodes_created;
+
+	/** The number of context tree nodes freed. */
+	long long ct_nodes_freed;
+
+	/** The time in seconds spent choosing actions and percepts within the
+	 * search tree, i.e. the time not accounted for below. */
+	double time_selection;
+
+	/** The time in seconds spent updating the model with the actions and
+	 * percepts chosen within the search tree. */
+	double time_sampling;
+
+	/** The time in seconds spent in playouts. */
+	double time_playout;
+
+	/** The time in seconds spent reverting the model after simulations. */
+	double time_revert;
+
+	/** The number of transposition table lookups. */
+	long long transposition_lookups;
+
+	/** The number of transposition table lookups that found a node. */
+	long long transposition_hits;
+
+	/** Add the statistics of a search of another part of the same search
+	 * budget, e.g. by another thread (see Agent::parallelSearch()).
+	 * \param other The statistics to add. */
+	void add(search_stats_t const& other);
+};
+
+
+/** The statistics of the actions of a decision node of the search tree.
+ * Storing them with the parent keeps the UCB computation in
+ * SearchNode::selectActionIndex() within contiguous arrays. */
+struct action_stats_t {
+	/** The order in which the actions are considered with action widening
+	 * (see Agent::actionsConsidered()), or empty if they are considered in
+	 * increasing order. */
+	std::vector<action_t> order;
+
+	/** The number of times each action was sampled, in the order of
+	 * action_stats_t::order. Unless nodes are shared (see
+	 * TranspositionTable), this equals the visits of the child nodes. The
+	 * counts are stored as doubles so that the computation can be
+	 * vectorized. */
+	std::vector<double> visits;
+
+	/** The mean reward of each action, in the order of
+	 * action_stats_t::order. */
+	std::vector<double> mean;
+};
+
+
+/** A bounded table of search nodes indexed by a hash of the context in which
+ * they were reached (see Agent::newSearchNode()). Different sequences of
+ * actions and percepts often end in the same recent history, for which the
+ * context tree makes (nearly) identical predictions. Sharing the nodes of such
+ * histories turns the search tree into a directed acyclic graph whose
+ * statistics are pooled.
+ *
+ * The table consists of buckets of TranspositionTable::cBucketSize entries.
+ * When a bucket is full, the entry whose node has the fewest visits is
+ * replaced. The table does not own the nodes.
+ *
+ * The model is not necessarily in the same state on every visit to a shared
+ * chance node, so its PerceptCache only approximates the percept
+ * distribution, and the version of the model it may hold is that of the
+ * first simulation to reach the node. */
+class TranspositionTable {
+public:
+
+	/** Create an empty table.
+	 * \param size The maximum number of entries. */
+	TranspositionTable(size_t size);
+
+	/** Find the node stored under a key.
+	 * \param key The key of the node.
+	 * \return The node, or NULL if there is none. */
+	SearchNode *find(context_hash_t key);
+
+	/** Store a node under a key, replacing the least visited entry of its
+	 * bucket if necessary.
+	 * \param key The key of the node.
+	 * \param node The node. */
+	void insert(context_hash_t key, SearchNode *node);
+
+	/** Remove all entries and reset the lookup counts. */
+	void clear(void);
+
+	/** \return The number of lookups since the table was cleared. */
+	long long lookups(void) const { return m_lookups; }
+
+	/** \return The number of successful lookups since the table was
+	 * cleared. */
+	long long hits(void) const { return m_hits; }
+
+private:
+	/** The number of entries in each bucket. */
+	static const size_t cBucketSize = 2;
+
+	/** An entry of the table. */
+	struct entry_t {
+		context_hash_t key;
+		SearchNode *node;
+	};
+
+	/** The entries of the table, bucket by bucket. */
+	std::vector<entry_t> m_entries;
+
+	/** The number of lookups since the table was cleared. */
+	long long m_lookups;
+
+	/** The number of successful lookups since the table was cleared. */
+	long long m_hits;
+};
 
 
 /** Represents a node in the Monte Carlo search tree. The nodes in the search
@@ -52,9 +288,17 @@ public:
 	/** Create and initialise a new search node of a specific type. */
 	SearchNode(const nodetype_t nodetype);
 
-	/** Destroy all child nodes. */
+	/** Destroy all child nodes that are not shared with another parent. */
 	~SearchNode(void);
 
+	/** Register an additional owner of a node, e.g. a parent or the agent. */
+	void retain(void) { m_parents++; }
+
+	/** Unregister an owner of a node, destroying the node if it was the
+	 * last one.
+	 * \param node The node. */
+	static void release(SearchNode *node);
+
 	/** Determine which action to sample according to the UCB policy.
 	 * \param agent The agent which is doing the sampling.
 	 * \return The selected action. */
@@ -79,7 +323,51 @@ public:
 	 * \return A pointer to the child node if it exists, otherwise return NULL. */
 	SearchNode *child(const interaction_t child_index) const;
 
+	/** \return The type of this node. */
+	nodetype_t type(void) const { return m_type; }
+
+	/** \return The number of nodes in the tree rooted at this node. Nodes
+	 * with several parents are counted once. */
+	size_t size(void) const;
+
+	/** Forget the percept distributions stored at the chance nodes of the
+	 * tree rooted at this node, as they are only valid for the model which
+	 * computed them. */
+	void clearPerceptCaches(void);
+
 private:
+	/** Count the nodes of the tree rooted at this node which are not
+	 * already in a set of shared nodes.
+	 * \param shared The nodes with several parents counted so far, to which
+	 *     those found are added.
+	 * \return The number of nodes. */
+	size_t size(std::unordered_set<SearchNode const*> &shared) const;
+
+	/** Determine which action to sample according to the UCB policy.
+	 * \param agent The agent which is doing the sampling.
+	 * \return The position of the selected action in
+	 * action_stats_t::order. */
+	int selectActionIndex(Agent const& agent);
+
+	/** \return The action at a position of action_stats_t::order. */
+	action_t action(int index) const {
+		return m_actions == NULL || m_actions->order.empty() ? index
+			: m_actions->order[index];
+	}
+
+	/** Choose a child of this chance node with probability proportional to
+	 * its number of visits (see Agent::admitPercept()).
+	 * \return The index of the child node. */
+	interaction_t selectPercept(void) const;
+
+	/** Find or create the child node with a certain index.
+	 * \param agent The agent which is doing the sampling.
+	 * \param child_index The index of the child node.
+	 * \param horizon How many cycles into the future the child will sample.
+	 * \return The child node. */
+	SearchNode *findChild(Agent &agent, const interaction_t child_index,
+	                      const int horizon);
+
 	/** The children of this node. Each corresponds to an action if this is a
 	 * decision node or to a percept if this is a chance node. */
 	child_map_t m_child;
@@ -93,6 +381,22 @@ private:
 
 	/** The number of times this node has been visited. */
 	visits_t m_visits;
+
+	/** The number of owners of this node: its parents (search nodes can be
+	 * shared via a TranspositionTable), and the agent if this node is the
+	 * root of a search tree. */
+	int m_parents;
+
+	/** The statistics of the actions of this node, if it is a decision node
+	 * which has selected an action, or NULL. Like
+	 * SearchNode::m_percept_cache, it is only allocated for the type of node
+	 * which uses it, which keeps the nodes small. */
+	action_stats_t *m_actions;
+
+	/** The percept distribution at this node, if it is a chance node, or
+	 * NULL. This allows percepts to be sampled without consulting the
+	 * agent's model (see Agent::simulatePercept()). */
+	PerceptCache *m_percept_cache;
 };
 
 
@@ -1,8 +1,12 @@
 #include <cassert>
 #include <cstdlib>
 #include <iostream>
+#include <random>
 #include "util.hpp"
 
+// The random number generator of the current thread, if it has one
+static thread_local std::mt19937 *thread_generator = NULL;
+
 // Count the number of bits needed to store x >= 0
 int bitsRequired(const int x) {
 	assert(x >= 0);
@@ -12,9 +16,84 @@ int bitsRequired(const int x) {
 }
 
 
+// Return a random integer between [0, RAND_MAX], from the thread's generator
+// if it has one
+static int randInt() {
+	if (thread_generator != NULL)
+		return int((*thread_generator)() & RAND_MAX);
+	return rand();
+}
+
+
+void setThreadRandomStream(unsigned int seed, unsigned int stream) {
+	std::seed_seq seq = {seed, stream};
+	clearThreadRandomStream();
+	thread_generator = new std::mt19937(seq);
+}
+
+
+void clearThreadRandomStream() {
+	delete thread_generator;
+	thread_generator = NULL;
+}
+
+
+WorkerPool::WorkerPool(const size_t threads, const unsigned int seed) :
+	m_task(NULL), m_generation(0), m_pending(0), m_stop(false)
+{
+	for (size_t i = 0; i < threads; i++)
+		m_threads.push_back(std::thread(&WorkerPool::loop, this, seed, i));
+}
+
+
+WorkerPool::~WorkerPool(void) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_start.notify_all();
+	for (size_t i = 0; i < m_threads.size(); i++)
+		m_threads[i].join();
+}
+
+
+// Hand the task to every thread, then wait until the last one is done
+void WorkerPool::run(std::function<void(size_t)> const& task) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_task = &task;
+	m_pending = m_threads.size();
+	m_generation++;
+	m_start.notify_all();
+	m_done.wait(lock, [this]() { return m_pending == 0; });
+	m_task = NULL;
+}
+
+
+void WorkerPool::loop(const unsigned int seed, const size_t index) {
+	setThreadRandomStream(seed, unsigned(index));
+	unsigned long generation = 0;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_start.wait(lock, [this, &generation]() {
+			return m_stop || m_generation != generation;
+		});
+		if (m_stop)
+			break;
+		generation = m_generation;
+		std::function<void(size_t)> const &task = *m_task;
+		lock.unlock();
+		task(index);
+		lock.lock();
+		if (--m_pending == 0)
+			m_done.notify_one();
+	}
+	clearThreadRandomStream();
+}
+
+
 // Return a number uniformly between [0, 1]
 double rand01() {
-	return double(rand()) / double(RAND_MAX);
+	return double(randInt()) / double(RAND_MAX);
 }
 
 
@@ -23,9 +102,9 @@ int randRange(int end) {
 	assert(0 <= end && end <= RAND_MAX);
 
 	// Generate an integer between [0, end) uniformly using rejection sampling.
-	int r = rand();
+	int r = randInt();
 	const int remainder = RAND_MAX % end;
-	while (r < remainder) r = rand();
+	while (r < remainder) r = randInt();
 	return r % end;
 }
 
@@ -1,7 +1,12 @@
 #ifndef __UTIL_HPP__
 #define __UTIL_HPP__
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 #include "main.hpp"
 
 
@@ -13,6 +18,58 @@ int bitsRequired(const int x);
 double rand01();
 
 
+/** Make the calling thread draw random numbers (rand01(), randRange()) from
+ * its own generator rather than rand(). The generator is seeded from both a
+ * seed and a stream number, so that threads given the same seed but different
+ * stream numbers draw different, reproducible sequences.
+ * \param seed The seed.
+ * \param stream The stream number. */
+void setThreadRandomStream(unsigned int seed, unsigned int stream);
+
+
+/** Make the calling thread draw random numbers from rand() again. */
+void clearThreadRandomStream();
+
+
+/** A fixed set of threads which run tasks together. The threads are created
+ * once and wait between tasks, so a task may be as short as a cycle of the
+ * agent. Each thread draws random numbers from its own stream (see
+ * setThreadRandomStream()). */
+class WorkerPool {
+public:
+
+	/** Start the threads.
+	 * \param threads The number of threads.
+	 * \param seed The seed of the random streams of the threads, whose stream
+	 *     numbers are their indices. */
+	WorkerPool(const size_t threads, const unsigned int seed);
+
+	/** Stop the threads. */
+	~WorkerPool(void);
+
+	/** Run a task in every thread and wait for all of them to finish it.
+	 * \param task The task, given the index of the thread. */
+	void run(std::function<void(size_t)> const& task);
+
+	/** \return The number of threads. */
+	size_t size(void) const { return m_threads.size(); }
+
+private:
+
+	/** Wait for tasks and run them until the pool is stopped. */
+	void loop(const unsigned int seed, const size_t index);
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_start; // Signals a new task, or the stop
+	std::condition_variable m_done;  // Signals the end of the current task
+	std::function<void(size_t)> const *m_task;
+	unsigned long m_generation; // The number of tasks run so far
+	size_t m_pending; // The number of threads yet to finish the current task
+	bool m_stop;
+};
+
+
 /** Sample an integer from a specified range uniformly at random.
  * \param end The end of the range (exclusive) to sample from.
  * \return A random integer greater than or equal to 0 and less than end. */
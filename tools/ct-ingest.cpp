@@ -0,0 +1,108 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+
+#include "../src/predict.hpp"
+#include "../src/util.hpp"
+
+
+/** The peak resident memory of the process in kilobytes. */
+long peakMemory(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+
+/** Read an integer argument of at least a minimum value, or exit. */
+int intArgument(char const *arg, char const *name, const int minimum) {
+	const int value = atoi(arg);
+	if (value < minimum || (value == 0 && std::string(arg) != "0")) {
+		std::cerr << "ERROR: Invalid " << name << " '" << arg << "'"
+			<< std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return value;
+}
+
+
+/** Train a context tree on the log of a run, as the agent would have learnt
+ * it: the percepts are learnt and the actions only added to the history.
+ * Percepts are encoded reward first, as in Agent::encodePercept(). The tree
+ * learns with ContextTree::updateInBulk(), and the number of cycles, the
+ * speed, the log block probability and the peak memory are printed. The
+ * model, and so the log block probability, is the same for any number of
+ * threads. */
+int main(int argc, char *argv[]) {
+	if (argc != 7) {
+		std::cerr << "Usage: " << argv[0]
+			<< " depth observation-bits reward-bits action-bits threads log"
+			<< std::endl << "The bits are those of the environment that "
+			<< "wrote the log." << std::endl;
+		return EXIT_FAILURE;
+	}
+	const int depth = intArgument(argv[1], "depth", 1);
+	const int observation_bits = intArgument(argv[2], "observation-bits",
+		0);
+	const int reward_bits = intArgument(argv[3], "reward-bits", 0);
+	const int action_bits = intArgument(argv[4], "action-bits", 1);
+	const int threads = intArgument(argv[5], "threads", 1);
+
+	std::ifstream log(argv[6]);
+	if (!log.is_open()) {
+		std::cerr << "ERROR: Could not open file '" << argv[6] << "'"
+			<< std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// Skip the header, then read the observation, reward and action of
+	// each cycle
+	symbol_list_t symbols, learn;
+	unsigned long long cycles = 0;
+	std::string line;
+	std::getline(log, line);
+	while (std::getline(log, line)) {
+		std::istringstream fields(line);
+		unsigned long long cycle;
+		interaction_t observation, reward, action;
+		char comma;
+		if (!(fields >> cycle >> comma >> observation >> comma >> reward
+				>> comma >> action))
+			continue;
+		if (observation >> observation_bits || reward >> reward_bits
+				|| action >> action_bits) {
+			std::cerr << "ERROR: Cycle " << cycle << " does not fit in the "
+				<< "given bits" << std::endl;
+			return EXIT_FAILURE;
+		}
+		encode(symbols, reward, reward_bits);
+		encode(symbols, observation, observation_bits);
+		learn.resize(symbols.size(), true);
+		encode(symbols, action, action_bits);
+		learn.resize(symbols.size(), false);
+		cycles++;
+	}
+
+	ContextTree ct(depth);
+	const std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	ct.updateInBulk(symbols, learn, threads);
+	const double seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "cycles: " << cycles << std::endl;
+	std::cout << "symbols: " << symbols.size() << std::endl;
+	std::cout << "time (s): " << seconds << std::endl;
+	std::cout << "symbols/sec: "
+		<< (seconds > 0.0 ? double(symbols.size()) / seconds : 0.0)
+		<< std::endl;
+	std::cout << "log block probability: " << ct.logBlockProbability()
+		<< std::endl;
+	std::cout << "context tree nodes: " << ct.size() << std::endl;
+	std::cout << "peak memory (KB): " << peakMemory() << std::endl;
+	return EXIT_SUCCESS;
+}
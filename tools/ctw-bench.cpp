@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+
+#include "../src/predict.hpp"
+
+
+/** A binary arithmetic coder. The interval [m_low, m_high] is split at each
+ * bit in proportion to the predicted probability of a one, and the leading
+ * bytes of the interval are written out (or read in) as soon as they are
+ * known. */
+class ArithmeticCoder {
+public:
+
+	/** Start encoding to a stream, or decoding from it.
+	 * \param stream The stream.
+	 * \param decode Whether to decode. */
+	ArithmeticCoder(std::fstream &stream, const bool decode) :
+		m_stream(stream), m_low(0), m_high(0xffffffff), m_code(0)
+	{
+		for (int i = 0; decode && i < 4; i++)
+			m_code = (m_code << 8) | readByte();
+	}
+
+
+	/** Encode a bit.
+	 * \param bit The bit.
+	 * \param p1 The probability that the bit is a one. */
+	void encode(const symbol_t bit, const double p1) {
+		const unsigned int mid = split(p1);
+		if (bit)
+			m_high = mid;
+		else
+			m_low = mid + 1;
+		while (((m_low ^ m_high) & 0xff000000) == 0) {
+			m_stream.put(char(m_high >> 24));
+			shift();
+		}
+	}
+
+
+	/** Decode a bit.
+	 * \param p1 The probability that the bit is a one.
+	 * \return The bit. */
+	symbol_t decode(const double p1) {
+		const unsigned int mid = split(p1);
+		const symbol_t bit = m_code <= mid;
+		if (bit)
+			m_high = mid;
+		else
+			m_low = mid + 1;
+		while (((m_low ^ m_high) & 0xff000000) == 0) {
+			shift();
+			m_code = (m_code << 8) | readByte();
+		}
+		return bit;
+	}
+
+
+	/** Write out enough bytes to identify the final interval. */
+	void flush(void) {
+		for (int i = 0; i < 4; i++, m_low <<= 8)
+			m_stream.put(char(m_low >> 24));
+	}
+
+private:
+
+	/** The end of the part of the interval which stands for a one. Both
+	 * parts are kept nonempty, however small the probability. */
+	unsigned int split(const double p1) const {
+		const double range = double(m_high - m_low);
+		double width = std::floor(range * p1);
+		width = std::min(std::max(width, 0.0), range - 1.0);
+		return m_low + (unsigned int)width;
+	}
+
+	/** Drop the leading byte of the interval. */
+	void shift(void) {
+		m_low <<= 8;
+		m_high = (m_high << 8) | 0xff;
+	}
+
+	/** Read a byte of the code, or zero past its end. */
+	unsigned int readByte(void) {
+		const int c = m_stream.get();
+		return c == EOF ? 0 : (unsigned int)(c);
+	}
+
+	std::fstream &m_stream;
+	unsigned int m_low;
+	unsigned int m_high;
+	unsigned int m_code;
+};
+
+
+/** The peak resident memory of the process in kilobytes. */
+long peakMemory(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+
+/** Stream a file through a context tree, a bit at a time from the most
+ * significant bit of each byte. Each bit is predicted
+ * (ContextTree::predict()) before the tree learns it (ContextTree::update()).
+ * Optionally, the bits are compressed with an ::ArithmeticCoder using the
+ * predictions, or decompressed from a file so compressed. The speed, the
+ * log-loss of the predictions and the peak memory are printed. */
+int main(int argc, char *argv[]) {
+	const std::string mode = argc > 1 ? argv[1] : "";
+	if (argc < 4 || argc > 5
+			|| (mode != "predict" && mode != "compress"
+				&& mode != "decompress")
+			|| (mode != "predict" && argc != 5)) {
+		std::cerr << "Usage: " << argv[0]
+			<< " predict|compress|decompress depth input [output]"
+			<< std::endl << "The output file is required to compress or "
+			<< "decompress. The depth must be the same for both."
+			<< std::endl;
+		return EXIT_FAILURE;
+	}
+	const int depth = atoi(argv[2]);
+	if (depth <= 0) {
+		std::cerr << "ERROR: Invalid depth '" << argv[2] << "'" << std::endl;
+		return EXIT_FAILURE;
+	}
+	const bool decompress = mode == "decompress";
+
+	std::fstream input(argv[3], std::ios::in | std::ios::binary);
+	if (!input.is_open()) {
+		std::cerr << "ERROR: Could not open file '" << argv[3] << "'"
+			<< std::endl;
+		return EXIT_FAILURE;
+	}
+	std::fstream output;
+	if (argc == 5) {
+		output.open(argv[4], std::ios::out | std::ios::binary);
+		if (!output.is_open()) {
+			std::cerr << "ERROR: Could not open file '" << argv[4] << "'"
+				<< std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// A compressed file starts with the number of bytes it decompresses to
+	unsigned long long bytes = 0;
+	if (decompress) {
+		for (int i = 0; i < 8; i++)
+			bytes |= (unsigned long long)(input.get() & 0xff) << (8 * i);
+	} else {
+		input.seekg(0, std::ios::end);
+		bytes = (unsigned long long)(input.tellg());
+		input.seekg(0, std::ios::beg);
+		for (int i = 0; mode == "compress" && i < 8; i++)
+			output.put(char(bytes >> (8 * i)));
+	}
+	ArithmeticCoder *coder = mode == "compress"
+		? new ArithmeticCoder(output, false)
+		: decompress ? new ArithmeticCoder(input, true) : NULL;
+
+	ContextTree ct(depth);
+	double log_loss = 0.0;
+	const std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	for (unsigned long long i = 0; i < bytes; i++) {
+		int byte = decompress ? 0 : input.get();
+		for (int b = 7; b >= 0; b--) {
+			const double p1 = ct.predict(true);
+			symbol_t bit;
+			if (decompress) {
+				bit = coder->decode(p1);
+				byte |= int(bit) << b;
+			} else {
+				bit = (byte >> b) & 1;
+				if (coder)
+					coder->encode(bit, p1);
+			}
+			log_loss -= std::log2(bit ? p1 : 1.0 - p1);
+			ct.update(bit);
+		}
+		if (decompress)
+			output.put(char(byte));
+	}
+	if (mode == "compress")
+		coder->flush();
+	const double seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	delete coder;
+
+	const double bits = 8.0 * double(bytes);
+	std::cout << "bits: " << 8 * bytes << std::endl;
+	std::cout << "time (s): " << seconds << std::endl;
+	std::cout << "bits/sec: " << (seconds > 0.0 ? bits / seconds : 0.0)
+		<< std::endl;
+	std::cout << "log-loss (bits): " << log_loss << std::endl;
+	std::cout << "log-loss (bits/bit): " << (bits > 0.0 ? log_loss / bits : 0.0)
+		<< std::endl;
+	if (mode == "compress")
+		std::cout << "compressed size (bytes): " << output.tellp() << std::endl;
+	std::cout << "context tree nodes: " << ct.size() << std::endl;
+	std::cout << "peak memory (KB): " << peakMemory() << std::endl;
+	return EXIT_SUCCESS;
+}